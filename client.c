@@ -0,0 +1,123 @@
+#include "client.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static uint32_t next_id = 0;
+
+// Returns 1 on success and 0 on failure
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n <= 0)
+            return 0;
+        data += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+// Returns 1 on success and 0 on failure
+static int read_all(int fd, char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = read(fd, data, length);
+        if (n <= 0)
+            return 0;
+        data += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+int client_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void client_close(int conn)
+{
+    close(conn);
+}
+
+int client_send(int conn, int op, int inumber, const char *data, int length, int offset)
+{
+    struct proto_request request = { next_id++, op, inumber, offset, length };
+
+    if (length < 0 || length > PROTO_MAX_LENGTH)
+        return 0;
+    if (!write_all(conn, (const char *)&request, sizeof(request)))
+        return 0;
+    if (op == PROTO_WRITE && !write_all(conn, data, length))
+        return 0;
+
+    return 1;
+}
+
+int client_receive(int conn, struct proto_response *response, char *data)
+{
+    if (!read_all(conn, (char *)response, sizeof(*response)))
+        return 0;
+    if (response->length < 0 || response->length > PROTO_MAX_LENGTH)
+        return 0;
+
+    return read_all(conn, data, response->length);
+}
+
+// Sends one request and waits for its response
+static int call(int conn, int op, int inumber, char *data, int length, int offset)
+{
+    struct proto_response response;
+
+    if (!client_send(conn, op, inumber, data, length, offset) || !client_receive(conn, &response, data))
+        return -1;
+
+    return response.result;
+}
+
+int client_create(int conn)
+{
+    return call(conn, PROTO_CREATE, 0, NULL, 0, 0);
+}
+
+int client_delete(int conn, int inumber)
+{
+    return call(conn, PROTO_DELETE, inumber, NULL, 0, 0);
+}
+
+int client_getsize(int conn, int inumber)
+{
+    return call(conn, PROTO_GETSIZE, inumber, NULL, 0, 0);
+}
+
+int client_read(int conn, int inumber, char *data, int length, int offset)
+{
+    return call(conn, PROTO_READ, inumber, data, length, offset);
+}
+
+int client_write(int conn, int inumber, const char *data, int length, int offset)
+{
+    return call(conn, PROTO_WRITE, inumber, (char *)data, length, offset);
+}
@@ -0,0 +1,29 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "proto.h"
+
+// Connect to a simplefs-server listening on the Unix socket at path
+// Returns the connection on success and -1 on failure
+int client_connect(const char *path);
+
+void client_close(int conn);
+
+// Queue a request without waiting for its response, data is only sent for
+// PROTO_WRITE. Responses come back in the order requests were sent
+// Returns 1 on success and 0 on failure
+int client_send(int conn, int op, int inumber, const char *data, int length, int offset);
+
+// Wait for the next response, the payload of a read is stored in data
+// Returns 1 on success and 0 on failure
+int client_receive(int conn, struct proto_response *response, char *data);
+
+// Blocking calls that behave like their fs_* counterparts
+// Each returns the fs_* result, or -1 if the server could not be reached
+int client_create(int conn);
+int client_delete(int conn, int inumber);
+int client_getsize(int conn, int inumber);
+int client_read(int conn, int inumber, char *data, int length, int offset);
+int client_write(int conn, int inumber, const char *data, int length, int offset);
+
+#endif
@@ -0,0 +1,202 @@
+#include "client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#define CHUNK 65536     // bytes moved by one request
+#define WINDOW 16       // requests kept in flight by copyin and copyout
+
+static int do_copyin(int conn, const char *filename, int inumber);
+static int do_copyout(int conn, int inumber, const char *filename);
+
+static void usage(const char *program)
+{
+    printf("use: %s <socket> <command> [args]\n", program);
+    printf("Commands are:\n");
+    printf("    create\n");
+    printf("    delete  <inode>\n");
+    printf("    getsize <inode>\n");
+    printf("    cat     <inode>\n");
+    printf("    copyin  <file> <inode>\n");
+    printf("    copyout <inode> <file>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int conn, inumber, result, ok = 1;
+
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    conn = client_connect(argv[1]);
+    if (conn < 0)
+    {
+        printf("couldn't connect to %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    const char *cmd = argv[2];
+    if (!strcmp(cmd, "create") && argc == 3)
+    {
+        inumber = client_create(conn);
+        if ((ok = inumber >= 0))
+            printf("created inode %d\n", inumber);
+        else
+            printf("create failed!\n");
+    }
+    else if (!strcmp(cmd, "delete") && argc == 4)
+    {
+        inumber = atoi(argv[3]);
+        if ((ok = client_delete(conn, inumber) == 1))
+            printf("inode %d deleted.\n", inumber);
+        else
+            printf("delete failed!\n");
+    }
+    else if (!strcmp(cmd, "getsize") && argc == 4)
+    {
+        inumber = atoi(argv[3]);
+        result = client_getsize(conn, inumber);
+        if ((ok = result >= 0))
+            printf("inode %d has size %d\n", inumber, result);
+        else
+            printf("getsize failed!\n");
+    }
+    else if (!strcmp(cmd, "cat") && argc == 4)
+    {
+        if (!(ok = do_copyout(conn, atoi(argv[3]), "/dev/stdout")))
+            printf("cat failed!\n");
+    }
+    else if (!strcmp(cmd, "copyin") && argc == 5)
+    {
+        inumber = atoi(argv[4]);
+        if ((ok = do_copyin(conn, argv[3], inumber)))
+            printf("copied file %s to inode %d\n", argv[3], inumber);
+        else
+            printf("copy failed!\n");
+    }
+    else if (!strcmp(cmd, "copyout") && argc == 5)
+    {
+        inumber = atoi(argv[3]);
+        if ((ok = do_copyout(conn, inumber, argv[4])))
+            printf("copied inode %d to file %s\n", inumber, argv[4]);
+        else
+            printf("copy failed!\n");
+    }
+    else
+    {
+        usage(argv[0]);
+        ok = 0;
+    }
+
+    client_close(conn);
+
+    return !ok;
+}
+
+// Keeps up to WINDOW writes in flight. The server applies them in order, so
+// each one extends the file the previous one left behind
+static int do_copyin(int conn, const char *filename, int inumber)
+{
+    FILE *file;
+    struct proto_response response;
+    int lengths[WINDOW];
+    int sent = 0, received = 0, offset = 0, copied = 0, failed = 0, result;
+    char *buffer = malloc(CHUNK);
+
+    file = fopen(filename, "r");
+    if (!file || !buffer)
+    {
+        printf("couldn't open %s: %s\n", filename, strerror(errno));
+        free(buffer);
+        return 0;
+    }
+
+    while (1)
+    {
+        if (!failed && sent - received < WINDOW)
+        {
+            result = fread(buffer, 1, CHUNK, file);
+            if (result > 0)
+            {
+                if (!client_send(conn, PROTO_WRITE, inumber, buffer, result, offset))
+                    break;
+                lengths[sent++ % WINDOW] = result;
+                offset += result;
+                continue;
+            }
+        }
+        if (received == sent)
+            break;
+
+        if (!client_receive(conn, &response, NULL))
+            break;
+        if (response.result != lengths[received++ % WINDOW])
+        {
+            if (!failed)
+                printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n", response.result, lengths[(received - 1) % WINDOW]);
+            failed = 1;
+        }
+        if (!failed)
+            copied += response.result;
+    }
+
+    printf("%d bytes copied\n", copied);
+
+    fclose(file);
+    free(buffer);
+    return received == sent;
+}
+
+// Asks for the size first, then keeps up to WINDOW reads in flight
+static int do_copyout(int conn, int inumber, const char *filename)
+{
+    FILE *file;
+    struct proto_response response;
+    int size, sent = 0, received = 0, copied = 0;
+    char *buffer = malloc(CHUNK);
+
+    size = client_getsize(conn, inumber);
+    if (size < 0 || !buffer)
+    {
+        free(buffer);
+        return 0;
+    }
+
+    file = fopen(filename, "w");
+    if (!file)
+    {
+        printf("couldn't open %s: %s\n", filename, strerror(errno));
+        free(buffer);
+        return 0;
+    }
+
+    while (1)
+    {
+        if (sent * CHUNK < size && sent - received < WINDOW)
+        {
+            if (!client_send(conn, PROTO_READ, inumber, NULL, CHUNK, sent * CHUNK))
+                break;
+            sent++;
+            continue;
+        }
+        if (received == sent)
+            break;
+
+        if (!client_receive(conn, &response, buffer) || response.result < 0)
+            break;
+        received++;
+        fwrite(buffer, 1, response.length, file);
+        copied += response.length;
+    }
+
+    printf("%d bytes copied\n", copied);
+
+    fclose(file);
+    free(buffer);
+    return received == sent;
+}
@@ -0,0 +1,85 @@
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78     // reflected Castagnoli polynomial
+
+// table[k][b] is the CRC of byte b followed by k zero bytes, which lets the
+// fallback consume eight bytes per step
+static uint32_t table[8][256];
+static uint32_t (*update)(uint32_t crc, const unsigned char *p, size_t length);
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static uint32_t update_table(uint32_t crc, const unsigned char *p, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        p += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t update_sse42(uint32_t crc, const unsigned char *p, size_t length)
+{
+    uint64_t crc64 = crc;
+
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = crc64;
+    while (length--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#endif
+
+static void init()
+{
+    for (int b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; i++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++)
+        for (int k = 1; k < 8; k++)
+            table[k][b] = table[0][table[k - 1][b] & 0xff] ^ (table[k - 1][b] >> 8);
+
+    update = update_table;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        update = update_sse42;
+#endif
+}
+
+uint32_t crc32c(const void *data, size_t length)
+{
+    pthread_once(&once, init);
+
+    return ~update(~0u, data, length);
+}
@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns the CRC32C (Castagnoli) checksum of length bytes of data. Uses the
+// SSE4.2 crc32 instruction when the processor has it and a table otherwise
+uint32_t crc32c(const void *data, size_t length);
+
+#endif
@@ -3,29 +3,353 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "disk.h"
+#include "crc32c.h"
 
 #define DISK_MAGIC 0xdeadbeef
+#define DISK_DEFAULT_STRIPE_UNIT 65536
 
-static FILE *diskfile;
+// Bytes before the data in each file of a striped disk, which hold its
+// disk_member_header. A whole block keeps the data aligned
+#define DISK_MEMBER_HEADER 4096
+
+// Checksums cover fixed 1K units, the smallest block size, so they stay valid
+// whatever block size the file system picks
+#define DISK_CHECKSUM_UNIT 1024
+
+// Bytes read at a time when every block of the disk is checked
+#define DISK_SCAN_CHUNK (1 << 20)
+#define DISK_BLOCK_LOCKS 64
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// A multi-block transfer that the caller waits on until every member involved
+// has finished its part
+struct disk_batch
+{
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+// The part of a transfer that falls on one member. The stripe units of a
+// contiguous range of blocks are contiguous in each member file, so this is a
+// single vectored transfer
+struct disk_request
+{
+    int iswrite;
+    off_t offset;
+    struct iovec *iov;
+    int iovcnt;
+    struct disk_batch *batch;
+    struct disk_request *next;
+    double cost;
+};
+
+// One image file of the disk. Striped disks serve each member's requests on
+// its own thread
+struct disk_member
+{
+    FILE *file;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct disk_request *head;
+    struct disk_request *tail;
+    int stop;
+    off_t position;     // where the simulated head was left
+};
+
+// Simulated device timing, all times in microseconds
+struct disk_model
+{
+    double seek;        // seek across the whole member, scaled by the distance moved
+    double rotation;    // rotational delay of a request that doesn't follow the last one
+    double latency;     // fixed cost of every request
+    double bandwidth;   // transfer rate in bytes per microsecond
+};
+
+// Start of each file of a striped disk. It records the geometry the disk was
+// created with, so that its files can't be reopened in another layout
+struct disk_member_header
+{
+    uint32_t magic;
+    uint32_t stripeunit;
+    uint32_t nmembers;
+    uint32_t index;     // position of the file in the list given to disk_init
+};
+
+// Start of the checksum file kept next to the (first) disk file. The CRC32C of
+// every unit of the disk follows it
+struct disk_checksum_header
+{
+    uint32_t magic;     // DISK_MAGIC once every checksum has been computed
+    uint32_t unit;
+    uint64_t nunits;
+    int64_t mtime;      // modification time of the disk when the checksums were
+    int64_t mtimensec;  // last saved, which a write without them changes
+    uint32_t inuse;     // set while a session keeps the checksums
+    uint32_t unused;
+};
+
+// Blocks of the disk checked by one thread of a scan
+struct disk_scan
+{
+    pthread_t thread;
+    int first;
+    int last;
+    int rebuild;        // store the checksums instead of checking them
+    int bad;            // blocks that didn't match their checksum
+};
+
+static const struct disk_model hdd_model = { 15000, 4170, 0, 150 };
+static const struct disk_model ssd_model = { 0, 0, 80, 500 };
+
+static struct disk_member *members;
+static int nmembers = 0;
+static int stripeunit = DISK_DEFAULT_STRIPE_UNIT;
+static int stripeunitset = 0;
 static int nblocks = 0;
+static int blocksize = DISK_BLOCK_SIZE;
+static off_t disksize = 0;
+static off_t membersize = 0;
+static off_t memberdata = 0;    // offset of the data in each file
 static int nreads = 0;
 static int nwrites = 0;
 
+static int modelenabled = 0;
+static struct disk_model model;
+static pthread_mutex_t modellock = PTHREAD_MUTEX_INITIALIZER;
+static double simreadtime = 0;
+static double simwritetime = 0;
+static long nseeks = 0;
+
+static int checksumsenabled = 0;
+static struct disk_checksum_header *checksumheader;
+static uint32_t *checksums;
+static size_t checksummapsize;
+// Taken shared by reads and exclusively by writes while checksums are kept, so
+// a block's data and its checksum change together. Blocks share the locks by
+// number
+static pthread_rwlock_t blocklocks[DISK_BLOCK_LOCKS];
+static pthread_once_t blocklocksonce = PTHREAD_ONCE_INIT;
+static struct timespec openmtime;   // modification time of the disk when opened
+
+static void *member_thread(void *arg);
+static int open_checksums(const char *path);
+static void build_checksums();
+static void close_checksums();
+static struct timespec disk_mtime();
+
+int disk_set_stripe_unit(int size)
+{
+    if (size <= 0 || nmembers > 0)
+        return 0;
+
+    stripeunit = size;
+    stripeunitset = 1;
+
+    return 1;
+}
+
+// Checks the header of every file of a striped disk, taking the stripe unit
+// from it unless one was set, then writes the headers of new files
+// Returns 1 on success and 0 if the files were created with another geometry
+static int check_geometry()
+{
+    struct disk_member_header header;
+    int adopted = stripeunitset;
+
+    if (!stripeunitset)
+        stripeunit = DISK_DEFAULT_STRIPE_UNIT;
+
+    for (int i = 0; i < nmembers; i++)
+    {
+        ssize_t result = pread(fileno(members[i].file), &header, sizeof(header), 0);
+        if (result == 0)
+            continue;
+        if (result != sizeof(header) || header.magic != DISK_MAGIC || header.nmembers != nmembers || header.index != i
+            || (adopted && header.stripeunit != stripeunit))
+        {
+            printf("ERROR: file %d of the disk was created with another stripe unit, file count or order\n", i + 1);
+            errno = EINVAL;
+            return 0;
+        }
+        stripeunit = header.stripeunit;
+        adopted = 1;
+    }
+
+    for (int i = 0; i < nmembers; i++)
+    {
+        struct disk_member_header header = { DISK_MAGIC, stripeunit, nmembers, i };
+        if (pwrite(fileno(members[i].file), &header, sizeof(header), 0) != sizeof(header))
+            return 0;
+    }
+
+    return 1;
+}
+
+int disk_set_model(const char *spec)
+{
+    char *copy = strdup(spec);
+    char *token, *saveptr;
+    struct disk_model parsed = { 0, 0, 0, 0 };
+
+    if (!copy)
+        return 0;
+
+    for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(token, '=');
+        if (!strcmp(token, "hdd"))
+            parsed = hdd_model;
+        else if (!strcmp(token, "ssd"))
+            parsed = ssd_model;
+        else if (value && !strncmp(token, "seek=", 5))
+            parsed.seek = atof(value + 1);
+        else if (value && !strncmp(token, "rotation=", 9))
+            parsed.rotation = atof(value + 1);
+        else if (value && !strncmp(token, "latency=", 8))
+            parsed.latency = atof(value + 1);
+        else if (value && !strncmp(token, "bandwidth=", 10))
+            parsed.bandwidth = atof(value + 1);
+        else
+            break;
+    }
+    free(copy);
+
+    // MB/s and bytes per microsecond are the same thing
+    if (token || parsed.bandwidth <= 0 || parsed.seek < 0 || parsed.rotation < 0 || parsed.latency < 0)
+        return 0;
+
+    model = parsed;
+    modelenabled = 1;
+
+    return 1;
+}
+
+int disk_set_checksums(int enable)
+{
+    if (nmembers > 0)
+        return 0;
+
+    checksumsenabled = enable;
+
+    return 1;
+}
+
+double disk_simulated_time()
+{
+    pthread_mutex_lock(&modellock);
+    double total = simreadtime + simwritetime;
+    pthread_mutex_unlock(&modellock);
+
+    return total;
+}
+
 int disk_init(const char *filename, int n)
 {
-    diskfile = fopen(filename, "r+");
-    if (!diskfile)
-        diskfile = fopen(filename, "w+");
-    if (!diskfile)
+    char *names = strdup(filename);
+    char *name, *saveptr;
+
+    if (!names)
         return 0;
 
-    ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+    nmembers = 1;
+    for (const char *c = filename; *c; c++)
+        if (*c == ',')
+            nmembers++;
+    members = calloc(nmembers, sizeof(struct disk_member));
+    if (!members)
+    {
+        free(names);
+        nmembers = 0;
+        return 0;
+    }
+
+    name = strtok_r(names, ",", &saveptr);
+    for (int i = 0; i < nmembers; i++, name = strtok_r(NULL, ",", &saveptr))
+    {
+        FILE *file = name ? fopen(name, "r+") : NULL;
+        if (name && !file)
+            file = fopen(name, "w+");
+        if (!file)
+        {
+            while (i-- > 0)
+                fclose(members[i].file);
+            free(members);
+            free(names);
+            members = NULL;
+            nmembers = 0;
+            return 0;
+        }
+        members[i].file = file;
+    }
+    free(names);
+    // taken before the files are resized, which counts as a modification
+    openmtime = disk_mtime();
+
+    // a comma separated list of files stripes the disk across all of them
+    disksize = (off_t)n * DISK_BLOCK_SIZE;
+    membersize = disksize;
+    memberdata = 0;
+    int ok = 1;
+    if (nmembers > 1)
+    {
+        ok = check_geometry();
+        off_t units = (disksize + stripeunit - 1) / stripeunit;
+        membersize = (units + nmembers - 1) / nmembers * stripeunit;
+        memberdata = DISK_MEMBER_HEADER;
+    }
+    for (int i = 0; ok && i < nmembers; i++)
+    {
+        ftruncate(fileno(members[i].file), memberdata + membersize);
+        members[i].position = memberdata;
+    }
+
+    // the checksums live next to the first file
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%.*s.crc", (int)strcspn(filename, ","), filename);
+    if (!ok || (checksumsenabled && !open_checksums(path)))
+    {
+        for (int i = 0; i < nmembers; i++)
+            fclose(members[i].file);
+        free(members);
+        members = NULL;
+        nmembers = 0;
+        return 0;
+    }
+
+    if (nmembers > 1)
+    {
+        for (int i = 0; i < nmembers; i++)
+        {
+            pthread_mutex_init(&members[i].lock, NULL);
+            pthread_cond_init(&members[i].ready, NULL);
+            pthread_create(&members[i].thread, NULL, member_thread, &members[i]);
+        }
+    }
 
     nblocks = n;
+    blocksize = DISK_BLOCK_SIZE;
     nreads = 0;
     nwrites = 0;
+    simreadtime = 0;
+    simwritetime = 0;
+    nseeks = 0;
+
+    if (checksums)
+        build_checksums();
 
     return 1;
 }
@@ -35,7 +359,33 @@ int disk_size()
     return nblocks;
 }
 
-static void sanity_check(int blocknum, const void *data)
+int disk_set_block_size(int size)
+{
+    if (size <= 0 || (checksumsenabled && size % DISK_CHECKSUM_UNIT))
+        return 0;
+
+    blocksize = size;
+    nblocks = disksize / size;
+
+    return 1;
+}
+
+int disk_block_size()
+{
+    return blocksize;
+}
+
+int disk_reads()
+{
+    return __atomic_load_n(&nreads, __ATOMIC_RELAXED);
+}
+
+int disk_writes()
+{
+    return __atomic_load_n(&nwrites, __ATOMIC_RELAXED);
+}
+
+static void sanity_check(int blocknum, int count, const void *data)
 {
     if (blocknum < 0)
     {
@@ -43,9 +393,9 @@ static void sanity_check(int blocknum, const void *data)
         abort();
     }
 
-    if (blocknum >= nblocks)
+    if (blocknum + count > nblocks)
     {
-        printf("ERROR: blocknum (%d) is too big!\n", blocknum);
+        printf("ERROR: blocknum (%d) is too big!\n", blocknum + count - 1);
         abort();
     }
 
@@ -56,47 +406,516 @@ static void sanity_check(int blocknum, const void *data)
     }
 }
 
-void disk_read(int blocknum, char *data)
+// Returns the simulated time a member takes to transfer length bytes at offset
+// and moves its head to the end of the transfer. Requests that don't start
+// where the last one ended pay for the seek and the rotational delay
+static double model_cost(struct disk_member *member, off_t offset, off_t length)
+{
+    double cost = model.latency + length / model.bandwidth;
+
+    pthread_mutex_lock(&modellock);
+    if (offset != member->position)
+    {
+        off_t distance = offset > member->position ? offset - member->position : member->position - offset;
+        cost += model.seek * distance / membersize + model.rotation;
+        nseeks++;
+    }
+    member->position = offset + length;
+    pthread_mutex_unlock(&modellock);
+
+    return cost;
+}
+
+// Transfers every byte of a request, at most IOV_MAX buffers at a time.
+// Blocks are transferred at explicit offsets so that several threads can
+// access a member at once
+static void do_request(struct disk_member *member, struct disk_request *request)
+{
+    off_t offset = request->offset;
+
+    for (int i = 0; i < request->iovcnt; i += IOV_MAX)
+    {
+        int iovcnt = request->iovcnt - i < IOV_MAX ? request->iovcnt - i : IOV_MAX;
+        ssize_t expected = 0, result;
+
+        for (int j = i; j < i + iovcnt; j++)
+            expected += request->iov[j].iov_len;
+
+        if (request->iswrite)
+            result = pwritev(fileno(member->file), request->iov + i, iovcnt, offset);
+        else
+            result = preadv(fileno(member->file), request->iov + i, iovcnt, offset);
+
+        if (result != expected)
+        {
+            printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+            abort();
+        }
+        offset += expected;
+    }
+
+    if (modelenabled)
+        request->cost = model_cost(member, request->offset, offset - request->offset);
+}
+
+static void *member_thread(void *arg)
+{
+    struct disk_member *member = arg;
+
+    pthread_mutex_lock(&member->lock);
+    while (1)
+    {
+        while (!member->head && !member->stop)
+            pthread_cond_wait(&member->ready, &member->lock);
+        if (!member->head)
+            break;
+
+        struct disk_request *request = member->head;
+        member->head = request->next;
+        if (!member->head)
+            member->tail = NULL;
+        pthread_mutex_unlock(&member->lock);
+
+        do_request(member, request);
+
+        struct disk_batch *batch = request->batch;
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->pending == 0)
+            pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+
+        pthread_mutex_lock(&member->lock);
+    }
+    pthread_mutex_unlock(&member->lock);
+
+    return NULL;
+}
+
+static void account_time(double cost, int iswrite)
+{
+    if (!modelenabled)
+        return;
+
+    pthread_mutex_lock(&modellock);
+    if (iswrite)
+        simwritetime += cost;
+    else
+        simreadtime += cost;
+    pthread_mutex_unlock(&modellock);
+}
+
+// Splits a range of blocks into the stripe units of each member and transfers
+// them. When more than one member is involved the members' threads transfer
+// their parts in parallel while the caller waits
+static void disk_transfer(int blocknum, int count, char *data, int iswrite)
 {
-    sanity_check(blocknum, data);
+    off_t start = (off_t)blocknum * blocksize;
+    off_t end = start + (off_t)count * blocksize;
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+    if (nmembers == 1)
+    {
+        struct iovec iov = { data, end - start };
+        struct disk_request request = { iswrite, start, &iov, 1, NULL, NULL, 0 };
+        do_request(&members[0], &request);
+        account_time(request.cost, iswrite);
+        return;
+    }
 
-    if (fread(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+    // count the stripe units falling on each member to size its buffer list
+    int nunits = (end - 1) / stripeunit - start / stripeunit + 1;
+    struct iovec *iov = malloc(nunits * sizeof(struct iovec));
+    struct disk_request *requests = calloc(nmembers, sizeof(struct disk_request));
+    if (!iov || !requests)
+    {
+        printf("ERROR: out of memory for disk transfer\n");
+        abort();
+    }
+    for (off_t unit = start / stripeunit; unit <= (end - 1) / stripeunit; unit++)
+        requests[unit % nmembers].iovcnt++;
+    for (int i = 0, used = 0; i < nmembers; i++)
     {
-        nreads++;
+        requests[i].iov = iov + used;
+        used += requests[i].iovcnt;
+        requests[i].iovcnt = 0;
+    }
+
+    for (off_t offset = start; offset < end;)
+    {
+        off_t unit = offset / stripeunit;
+        off_t within = offset % stripeunit;
+        off_t length = stripeunit - within < end - offset ? stripeunit - within : end - offset;
+        struct disk_request *request = &requests[unit % nmembers];
+
+        if (request->iovcnt == 0)
+        {
+            request->iswrite = iswrite;
+            request->offset = memberdata + unit / nmembers * stripeunit + within;
+        }
+        request->iov[request->iovcnt].iov_base = data + (offset - start);
+        request->iov[request->iovcnt].iov_len = length;
+        request->iovcnt++;
+        offset += length;
+    }
+
+    struct disk_batch batch = { 0 };
+    int last = 0;
+    for (int i = 0; i < nmembers; i++)
+    {
+        if (requests[i].iovcnt > 0)
+        {
+            batch.pending++;
+            last = i;
+        }
+    }
+
+    // a transfer within a single stripe unit is not worth handing off
+    if (batch.pending == 1)
+    {
+        do_request(&members[last], &requests[last]);
     }
     else
     {
-        printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.done, NULL);
+        for (int i = 0; i < nmembers; i++)
+        {
+            if (requests[i].iovcnt == 0)
+                continue;
+            requests[i].batch = &batch;
+            pthread_mutex_lock(&members[i].lock);
+            if (members[i].tail)
+                members[i].tail->next = &requests[i];
+            else
+                members[i].head = &requests[i];
+            members[i].tail = &requests[i];
+            pthread_cond_signal(&members[i].ready);
+            pthread_mutex_unlock(&members[i].lock);
+        }
+
+        pthread_mutex_lock(&batch.lock);
+        while (batch.pending > 0)
+            pthread_cond_wait(&batch.done, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+        pthread_mutex_destroy(&batch.lock);
+        pthread_cond_destroy(&batch.done);
+    }
+
+    // members work in parallel, so the transfer takes as long as the slowest
+    double cost = 0;
+    for (int i = 0; i < nmembers; i++)
+        if (requests[i].iovcnt > 0 && requests[i].cost > cost)
+            cost = requests[i].cost;
+    account_time(cost, iswrite);
+
+    free(requests);
+    free(iov);
+}
+
+// Checks or stores the checksums of a range of blocks. Returns the number of
+// blocks that didn't match, which is always 0 when storing
+static void init_block_locks()
+{
+    for (int i = 0; i < DISK_BLOCK_LOCKS; i++)
+        pthread_rwlock_init(&blocklocks[i], NULL);
+}
+
+// Locks every block of a range, taking the locks in order
+static void lock_blocks(int blocknum, int count, int write)
+{
+    pthread_once(&blocklocksonce, init_block_locks);
+    for (int i = 0; i < DISK_BLOCK_LOCKS; i++)
+    {
+        if (count < DISK_BLOCK_LOCKS && (i - blocknum % DISK_BLOCK_LOCKS + DISK_BLOCK_LOCKS) % DISK_BLOCK_LOCKS >= count)
+            continue;
+        if (write)
+            pthread_rwlock_wrlock(&blocklocks[i]);
+        else
+            pthread_rwlock_rdlock(&blocklocks[i]);
+    }
+}
+
+static void unlock_blocks(int blocknum, int count)
+{
+    for (int i = 0; i < DISK_BLOCK_LOCKS; i++)
+    {
+        if (count < DISK_BLOCK_LOCKS && (i - blocknum % DISK_BLOCK_LOCKS + DISK_BLOCK_LOCKS) % DISK_BLOCK_LOCKS >= count)
+            continue;
+        pthread_rwlock_unlock(&blocklocks[i]);
+    }
+}
+
+static int checksum_blocks(int blocknum, int count, const char *data, int store)
+{
+    int perblock = blocksize / DISK_CHECKSUM_UNIT;
+    size_t unit = (size_t)blocknum * perblock;
+    int bad = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int matches = 1;
+        for (int j = 0; j < perblock; j++, unit++, data += DISK_CHECKSUM_UNIT)
+        {
+            uint32_t crc = crc32c(data, DISK_CHECKSUM_UNIT);
+            if (store)
+                checksums[unit] = crc;
+            else if (crc != checksums[unit])
+                matches = 0;
+        }
+        if (!matches)
+        {
+            printf("block %d: checksum mismatch\n", blocknum + i);
+            bad++;
+        }
+    }
+
+    return bad;
+}
+
+static void *scan_thread(void *arg)
+{
+    struct disk_scan *scan = arg;
+    int chunk = DISK_SCAN_CHUNK / blocksize > 0 ? DISK_SCAN_CHUNK / blocksize : 1;
+    char *buffer = malloc((size_t)chunk * blocksize);
+
+    if (!buffer)
+    {
+        printf("ERROR: out of memory for disk scan\n");
+        abort();
+    }
+
+    for (int blocknum = scan->first; blocknum < scan->last; blocknum += chunk)
+    {
+        int count = scan->last - blocknum < chunk ? scan->last - blocknum : chunk;
+        lock_blocks(blocknum, count, 0);
+        disk_transfer(blocknum, count, buffer, 0);
+        __atomic_fetch_add(&nreads, count, __ATOMIC_RELAXED);
+        scan->bad += checksum_blocks(blocknum, count, buffer, scan->rebuild);
+        unlock_blocks(blocknum, count);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Reads the whole disk with one thread per processor, checking or storing
+// every checksum. Returns the number of blocks that didn't match
+static int scan_disk(int rebuild)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int bad = 0;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > nblocks)
+        nthreads = nblocks > 0 ? nblocks : 1;
+
+    struct disk_scan *scans = calloc(nthreads, sizeof(struct disk_scan));
+    if (!scans)
+    {
+        printf("ERROR: out of memory for disk scan\n");
         abort();
     }
+    for (int t = 0; t < nthreads; t++)
+    {
+        scans[t].first = (long long)t * nblocks / nthreads;
+        scans[t].last = (long long)(t + 1) * nblocks / nthreads;
+        scans[t].rebuild = rebuild;
+        if (pthread_create(&scans[t].thread, NULL, scan_thread, &scans[t]) != 0)
+        {
+            // scan this range on the current thread instead
+            scans[t].thread = 0;
+            scan_thread(&scans[t]);
+        }
+    }
+    for (int t = 0; t < nthreads; t++)
+    {
+        if (scans[t].thread != 0)
+            pthread_join(scans[t].thread, NULL);
+        bad += scans[t].bad;
+    }
+
+    free(scans);
+    return bad;
+}
+
+// Maps the checksum file kept at path
+// Returns 1 on success and 0 on failure
+static int open_checksums(const char *path)
+{
+    uint64_t nunits = disksize / DISK_CHECKSUM_UNIT;
+    struct stat info;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return 0;
+
+    checksummapsize = sizeof(struct disk_checksum_header) + nunits * sizeof(uint32_t);
+    if (fstat(fd, &info) < 0 || ((size_t)info.st_size != checksummapsize && ftruncate(fd, checksummapsize) < 0))
+    {
+        close(fd);
+        return 0;
+    }
+    checksumheader = mmap(NULL, checksummapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (checksumheader == MAP_FAILED)
+    {
+        checksumheader = NULL;
+        return 0;
+    }
+    checksums = (uint32_t *)(checksumheader + 1);
+    // a file of another size was made for another disk or header layout
+    if ((size_t)info.st_size != checksummapsize)
+        checksumheader->magic = 0;
+
+    return 1;
+}
+
+// Returns the latest modification time of the files of the disk
+static struct timespec disk_mtime()
+{
+    struct timespec latest = { 0, 0 };
+    struct stat info;
+
+    for (int i = 0; i < nmembers; i++)
+    {
+        if (fstat(fileno(members[i].file), &info) < 0)
+            continue;
+        if (info.st_mtim.tv_sec > latest.tv_sec ||
+            (info.st_mtim.tv_sec == latest.tv_sec && info.st_mtim.tv_nsec > latest.tv_nsec))
+            latest = info.st_mtim;
+    }
+
+    return latest;
+}
+
+// Computes every checksum if the checksum file is new, was made for a disk of
+// another size, or the disk was modified since the checksums were saved. A
+// session that ended without closing the disk left the file in use, and its
+// checksums are kept: they were updated with every write, and rebuilding them
+// would hide whatever made the session abort
+static void build_checksums()
+{
+    uint64_t nunits = disksize / DISK_CHECKSUM_UNIT;
+
+    if (checksumheader->magic == DISK_MAGIC && checksumheader->unit == DISK_CHECKSUM_UNIT && checksumheader->nunits == nunits &&
+        (checksumheader->inuse || (checksumheader->mtime == openmtime.tv_sec && checksumheader->mtimensec == openmtime.tv_nsec)))
+    {
+        checksumheader->inuse = 1;
+        return;
+    }
+
+    // the magic is only written once the checksums are complete
+    checksumheader->magic = 0;
+    checksumheader->unit = DISK_CHECKSUM_UNIT;
+    checksumheader->nunits = nunits;
+    scan_disk(1);
+    checksumheader->magic = DISK_MAGIC;
+    checksumheader->inuse = 1;
+}
+
+static void close_checksums()
+{
+    if (checksumheader)
+    {
+        // the disk files are still open and every write has finished
+        struct timespec mtime = disk_mtime();
+        checksumheader->mtime = mtime.tv_sec;
+        checksumheader->mtimensec = mtime.tv_nsec;
+        checksumheader->inuse = 0;
+        msync(checksumheader, checksummapsize, MS_SYNC);
+        munmap(checksumheader, checksummapsize);
+        checksumheader = NULL;
+        checksums = NULL;
+    }
+}
+
+int disk_scrub()
+{
+    if (!checksums)
+        return -1;
+
+    return scan_disk(0);
+}
+
+void disk_read(int blocknum, char *data)
+{
+    disk_read_blocks(blocknum, 1, data);
 }
 
 void disk_write(int blocknum, const char *data)
 {
-    sanity_check(blocknum, data);
+    disk_write_blocks(blocknum, 1, data);
+}
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+void disk_read_blocks(int blocknum, int count, char *data)
+{
+    sanity_check(blocknum, count, data);
 
-    if (fwrite(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+    if (!checksums)
     {
-        nwrites++;
+        disk_transfer(blocknum, count, data, 0);
+        __atomic_fetch_add(&nreads, count, __ATOMIC_RELAXED);
+        return;
     }
-    else
+
+    lock_blocks(blocknum, count, 0);
+    disk_transfer(blocknum, count, data, 0);
+    __atomic_fetch_add(&nreads, count, __ATOMIC_RELAXED);
+    int bad = checksum_blocks(blocknum, count, data, 0);
+    unlock_blocks(blocknum, count);
+    if (bad > 0)
     {
-        printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+        printf("ERROR: data read from disk doesn't match its checksum\n");
+        fflush(stdout);
         abort();
     }
 }
 
+void disk_write_blocks(int blocknum, int count, const char *data)
+{
+    sanity_check(blocknum, count, data);
+
+    if (checksums)
+        lock_blocks(blocknum, count, 1);
+    disk_transfer(blocknum, count, (char *)data, 1);
+    __atomic_fetch_add(&nwrites, count, __ATOMIC_RELAXED);
+    if (checksums)
+    {
+        checksum_blocks(blocknum, count, data, 1);
+        unlock_blocks(blocknum, count);
+    }
+}
+
 void disk_close()
 {
-    if (diskfile)
+    close_checksums();
+
+    if (members)
     {
         printf("%d disk block reads\n", nreads);
         printf("%d disk block writes\n", nwrites);
-        fclose(diskfile);
-        diskfile = 0;
+        if (modelenabled)
+        {
+            printf("%.3f ms simulated disk time (%.3f ms reading, %.3f ms writing)\n",
+                   (simreadtime + simwritetime) / 1000, simreadtime / 1000, simwritetime / 1000);
+            printf("%ld simulated seeks\n", nseeks);
+        }
+        for (int i = 0; i < nmembers; i++)
+        {
+            if (nmembers > 1)
+            {
+                pthread_mutex_lock(&members[i].lock);
+                members[i].stop = 1;
+                pthread_cond_signal(&members[i].ready);
+                pthread_mutex_unlock(&members[i].lock);
+                pthread_join(members[i].thread, NULL);
+                pthread_mutex_destroy(&members[i].lock);
+                pthread_cond_destroy(&members[i].ready);
+            }
+            fclose(members[i].file);
+        }
+        free(members);
+        members = 0;
+        nmembers = 0;
     }
 }
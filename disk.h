@@ -5,21 +5,85 @@
 
 // Init the disk. Use the existing disk file specified if valid, otherwise open
 // a new disk file. Initialize the disk to be nblocks * DISK_BLOCK_SIZE large.
+// A comma separated list of files stripes the disk across all of them, RAID-0
+// style, with each file served by its own I/O thread. Each file starts with a
+// header recording the stripe unit, the number of files and its position, and
+// the disk fails to open if the files are given in another layout
 // Returns 1 on success and 0 on failure
 int disk_init(const char *filename, int nblocks);
 
+// Set the number of bytes placed on one file of a striped disk before moving
+// on to the next. Existing disks use the unit they were created with when none
+// is set. Must be called before disk_init
+// Returns 1 on success and 0 on failure
+int disk_set_stripe_unit(int size);
+
+// Simulate the timing of a real device. spec is "hdd", "ssd" or a comma
+// separated list of settings, applied after an optional preset:
+//   seek=<us>       seek across the whole disk, scaled by the distance moved
+//   rotation=<us>   delay of each request that doesn't follow the previous one
+//   latency=<us>    fixed cost of every request
+//   bandwidth=<MB/s>
+// Time is only accounted, never slept. Must be called before disk_init
+// Returns 1 on success and 0 on failure
+int disk_set_model(const char *spec);
+
+// Keep a CRC32C checksum of every 1K of the disk in <diskfile>.crc, next to
+// the (first) disk file. Reads are checked against it and writes update it.
+// The file is built from the disk's contents if it is missing, doesn't fit the
+// disk, or the disk was modified since it was saved by disk_close by a run
+// without checksums. The checksums of a run that didn't close the disk are
+// kept, so a crash or checksum abort doesn't hide a bad block. Must be called
+// before disk_init
+// Returns 1 on success and 0 on failure
+int disk_set_checksums(int enable);
+
+// Returns the simulated time in microseconds spent on reads and writes so far,
+// or 0 if no model is set
+double disk_simulated_time();
+
 // Returns the size of the disk in number of blocks
 int disk_size();
 
+// Change the size of the blocks read and written, which starts out as
+// DISK_BLOCK_SIZE. The disk size in blocks becomes the number of whole blocks
+// of the new size that fit in the disk file
+// Returns 1 on success and 0 on failure
+int disk_set_block_size(int size);
+
+// Returns the size of a block in bytes
+int disk_block_size();
+
+// Returns the number of blocks read and written since disk_init
+int disk_reads();
+int disk_writes();
+
 // Reads one block of data from disk to the buffer provided. The buffer provided
-// must be at least DISK_BLOCK_SIZE bytes large
-// NOTE: Aborts on failure to read disk file
+// must be at least disk_block_size() bytes large
+// NOTE: Aborts on failure to read disk file or if checksums are kept and the
+// block doesn't match its checksum
+// disk_read and disk_write may be called from several threads at once
 void disk_read(int blocknum, char *data);
 
 // Writes one block of data from the buffer provided to disk
 // NOTE: Aborts on failure to write disk file
 void disk_write(int blocknum, const char *data);
 
+// Reads count consecutive blocks starting at blocknum into the buffer
+// provided, which must be at least count * disk_block_size() bytes large. On a
+// striped disk the files holding the blocks are read in parallel
+// NOTE: Aborts on failure to read disk file
+void disk_read_blocks(int blocknum, int count, char *data);
+
+// Writes count consecutive blocks starting at blocknum from the buffer provided
+// NOTE: Aborts on failure to write disk file
+void disk_write_blocks(int blocknum, int count, const char *data);
+
+// Check every block of the disk against its checksum, reading the disk from
+// one thread per processor. Each bad block is printed as it is found
+// Returns the number of bad blocks, or -1 if checksums are not kept
+int disk_scrub();
+
 // Close the disk file
 void disk_close();
 
@@ -1,5 +1,6 @@
 #include "fs.h"
 #include "disk.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -8,11 +9,15 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define FS_MAGIC 0xf0f03410
-#define INODES_PER_BLOCK 128
 #define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
+
+// Range of block sizes that can be chosen at format time
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
 
 // Returns the number of dedicated inode blocks given the disk size in blocks
 #define NUM_INODE_BLOCKS(disk_size_in_blocks) (1 + (disk_size_in_blocks / 10))
@@ -23,24 +28,95 @@ struct fs_superblock
     int nblocks;      // Size of the disk in number of blocks
     int ninodeblocks; // Number of blocks dedicated to inodes
     int ninodes;      // Number of dedicated inodes
+    int blocksize;    // Size of a block in bytes (0 on images from before it was configurable, which use DISK_BLOCK_SIZE)
+    int nameindex;    // First block of the name index (0 if the disk has none)
+    int nnameblocks;  // Number of blocks dedicated to the name index
+    int namemarks;    // 1 if named inodes carry FS_INODE_NAMED (0 on older images, whose deletes search the whole name index)
 };
 
+// Added to isvalid once a file is given a name, so that deleting a file that
+// never had one doesn't search the name index
+#define FS_INODE_NAMED 2
+
 struct fs_inode
 {
-    int isvalid;                    // 1 if valid (in use), 0 otherwise
+    int isvalid;                    // 1 if valid (in use), 0 otherwise, plus FS_INODE_NAMED
     int size;                       // Size of file in bytes
     int direct[POINTERS_PER_INODE]; // Direct data block numbers (0 if invalid)
     int indirect;                   // Indirect data block number (0 if invalid)
 };
 
+#define NAME_LENGTH 28
+
+// Entry of the name index. Unused entries are all zero, entries whose name
+// was removed keep an inumber of -1 so lookups keep probing past them
+struct fs_name
+{
+    int inumber;             // Inode the name refers to
+    char name[NAME_LENGTH];  // NUL terminated name, empty if the entry is unused
+};
+
+// Sized for the largest block, only the first blockSize bytes are used
 union fs_block
 {
-    struct fs_superblock super;              // Superblock
-    struct fs_inode inode[INODES_PER_BLOCK]; // Block of inodes
-    int pointers[POINTERS_PER_BLOCK];        // Indirect block of direct data block numbers
-    char data[DISK_BLOCK_SIZE];              // Data block
+    struct fs_superblock super;                                       // Superblock
+    struct fs_name names[MAX_BLOCK_SIZE / sizeof(struct fs_name)];    // Block of the name index
+    struct fs_inode inode[MAX_BLOCK_SIZE / sizeof(struct fs_inode)]; // Block of inodes
+    int pointers[MAX_BLOCK_SIZE / sizeof(int)];                      // Indirect block of direct data block numbers
+    char data[MAX_BLOCK_SIZE];                                        // Data block
 };
 
+// Geometry derived from the block size of the formatted or mounted disk
+static int blockSize = DISK_BLOCK_SIZE;
+static int blockShift = 12;   // log2(blockSize)
+static int inodesPerBlock = DISK_BLOCK_SIZE / sizeof(struct fs_inode);
+static int pointersPerBlock = DISK_BLOCK_SIZE / sizeof(int);
+static int namesPerBlock = DISK_BLOCK_SIZE / sizeof(struct fs_name);
+
+// Sets the block size used by the file system and the disk
+// Returns 1 on success and 0 if the size is not supported
+static int setBlockSize(int size) {
+  if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0) {
+    printf("error, block size must be a power of two from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    return 0;
+  }
+  if (!disk_set_block_size(size)) {
+    printf("error, disk can't use %d byte blocks\n", size);
+    return 0;
+  }
+  blockSize = size;
+  blockShift = __builtin_ctz(size);
+  inodesPerBlock = size / sizeof(struct fs_inode);
+  pointersPerBlock = size / sizeof(int);
+  namesPerBlock = size / sizeof(struct fs_name);
+  return 1;
+}
+
+// Returns the index of the first nonzero pointer at or after start in an
+// indirect block holding count pointers, or count if there is none
+static inline __attribute__((always_inline)) int findPointer(const int *pointers, int start, int count) {
+  for (int i = start; i < count; i++) {
+    if (pointers[i] != 0) {
+      return i;
+    }
+  }
+  return count;
+}
+
+// Returns the index of the next nonzero pointer in an indirect block, or
+// pointersPerBlock if there is none. Indirect blocks are mostly empty, so the
+// scan is specialized for the common block sizes where the count is constant
+static int nextPointer(const int *pointers, int start) {
+  switch (pointersPerBlock) {
+    case 4096 / sizeof(int):
+      return findPointer(pointers, start, 4096 / sizeof(int));
+    case 65536 / sizeof(int):
+      return findPointer(pointers, start, 65536 / sizeof(int));
+    default:
+      return findPointer(pointers, start, pointersPerBlock);
+  }
+}
+
 
 // TRUE  -> inode is free
 // FALSE -> inode is used
@@ -48,39 +124,269 @@ bool* freeInodesBitMap;
 
 bool* freeBlockBitMap;
 
-int findOpenINode() {
-  union fs_block block;
-  disk_read(0, block.data);
-  for (int i = 0; block.super.ninodes; i++) {
-    if (freeInodesBitMap[i] == true) {
-        return i;
-      }
+// Free inodes, popped to allocate one in constant time. Pushed in descending
+// order at mount so that the lowest inodes are handed out first
+int* freeInodeStack;
+int freeInodeCount;
+
+// Position of each free inode in freeInodeStack, so that a given inode can be
+// taken off it in constant time
+int* freeInodeSlot;
+
+// Number of free inodes in each inode block
+int* freeInodesInBlock;
+
+// Number of references (direct pointers, indirect pointers and indirect block
+// entries) to each data block, indexed the same way as freeBlockBitMap.
+// Clones share blocks, so a block is only free once its count drops to 0
+int* blockRefCounts;
+
+// Copy of the superblock of the mounted file system
+struct fs_superblock mountedSuper;
+
+// Blocks of the name index, read from disk the first time they are used
+char* nameCache;
+bool* nameCached;
+
+// Returns the index into freeBlockBitMap/blockRefCounts of a data block number
+static int blockIndex(int blocknum) {
+  return blocknum - mountedSuper.ninodeblocks - 1;
+}
+
+// Returns true if blocknum is one of the data blocks
+static bool inDataRegion(int blocknum) {
+  return blocknum > mountedSuper.ninodeblocks && blocknum < mountedSuper.nblocks;
+}
+
+// Takes a given free inode off the free inode stack, moving the top of the
+// stack into its place, and marks it as used
+static void takeInode(int inumber) {
+  int last = freeInodeStack[--freeInodeCount];
+  freeInodeStack[freeInodeSlot[inumber]] = last;
+  freeInodeSlot[last] = freeInodeSlot[inumber];
+  freeInodesBitMap[inumber] = false;
+  freeInodesInBlock[inumber / inodesPerBlock]--;
+}
+
+// Takes a free inode off the free inode stack and marks it as used
+// Returns the inode number, or -1 if there are no free inodes
+static int allocInode() {
+  if (freeInodeCount == 0) {
+    return -1;
   }
-  return -1;
+  int inumber = freeInodeStack[freeInodeCount - 1];
+  takeInode(inumber);
+  return inumber;
+}
+
+// Marks an inode as free and puts it back on the free inode stack
+static void freeInode(int inumber) {
+  freeInodesBitMap[inumber] = true;
+  freeInodeSlot[inumber] = freeInodeCount;
+  freeInodeStack[freeInodeCount++] = inumber;
+  freeInodesInBlock[inumber / inodesPerBlock]++;
 }
 
+// Returns the block number of a free data block, or -1 if the disk is full
 int findOpenBlock() {
-  union fs_block block;
-  disk_read(0, block.data);
-  for (int i = 0; i < block.super.nblocks - block.super.ninodeblocks; i++) {
+  for (int i = 0; i < mountedSuper.nblocks - mountedSuper.ninodeblocks - 1; i++) {
     if (freeBlockBitMap[i] == true) {
-      return i;
+      return i + mountedSuper.ninodeblocks + 1;
     }
   }
 
   return -1;
 }
 
-int findOpenIndirectBlock() {
-  union fs_block block;
-  disk_read(0, block.data);
-  for (int i = block.super.nblocks - block.super.ninodeblocks; i < block.super.nblocks; i++) {
-    if (freeBlockBitMap[i] == true) {
-      return i;
+// Allocates a free data block with a reference count of 1
+// Returns the block number, or -1 if the disk is full
+static int allocBlock() {
+  int blocknum = findOpenBlock();
+  if (blocknum == -1) {
+    return -1;
+  }
+  freeBlockBitMap[blockIndex(blocknum)] = false;
+  blockRefCounts[blockIndex(blocknum)] = 1;
+  return blocknum;
+}
+
+// Adds a reference to an allocated data block
+static void refBlock(int blocknum) {
+  freeBlockBitMap[blockIndex(blocknum)] = false;
+  blockRefCounts[blockIndex(blocknum)]++;
+}
+
+// Drops a reference to a data block, freeing and clearing it once nothing
+// refers to it. Freeing an indirect block drops the references it holds
+static void unrefBlock(int blocknum, bool isIndirect) {
+  if (--blockRefCounts[blockIndex(blocknum)] > 0) {
+    return;
+  }
+  if (isIndirect) {
+    union fs_block indirect;
+    disk_read(blocknum, indirect.data);
+    for (int i = nextPointer(indirect.pointers, 0); i < pointersPerBlock; i = nextPointer(indirect.pointers, i + 1)) {
+      if (inDataRegion(indirect.pointers[i])) {
+        unrefBlock(indirect.pointers[i], false);
+      }
     }
   }
+  union fs_block empty;
+  memset(empty.data, 0, blockSize);
+  disk_write(blocknum, empty.data);
+  freeBlockBitMap[blockIndex(blocknum)] = true;
+}
 
-  return -1;
+// Returns the cached copy of a block of the name index, reading it on first use
+static struct fs_name *nameBlock(int i) {
+  struct fs_name *names = (struct fs_name *)(nameCache + (size_t)i * blockSize);
+  if (!nameCached[i]) {
+    disk_read(mountedSuper.nameindex + i, (char *)names);
+    nameCached[i] = true;
+  }
+  return names;
+}
+
+// Writes a cached block of the name index back to disk
+static void writeNameBlock(int i) {
+  disk_write(mountedSuper.nameindex + i, nameCache + (size_t)i * blockSize);
+}
+
+// FNV-1a hash of a name, selecting the block of the name index to start at
+static unsigned int hashName(const char *name) {
+  unsigned int hash = 2166136261u;
+  for (; *name; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
+  return hash;
+}
+
+// Finds the entry for a name. Names that hash to a full block continue in the
+// following blocks, so probing stops at the first block with a never used entry.
+// Returns the entry, or NULL if the name is not in the index. If unused is not
+// NULL it is set to the first unused or removed entry seen, or NULL if none
+static struct fs_name *findName(const char *name, struct fs_name **unused) {
+  if (unused != NULL) {
+    *unused = NULL;
+  }
+  int first = hashName(name) % mountedSuper.nnameblocks;
+  for (int n = 0; n < mountedSuper.nnameblocks; n++) {
+    struct fs_name *names = nameBlock((first + n) % mountedSuper.nnameblocks);
+    bool endOfProbe = false;
+    for (int j = 0; j < namesPerBlock; j++) {
+      if (names[j].name[0] == '\0') {
+        if (unused != NULL && *unused == NULL) {
+          *unused = &names[j];
+        }
+        endOfProbe |= names[j].inumber == 0;
+      } else if (strncmp(names[j].name, name, NAME_LENGTH) == 0) {
+        return &names[j];
+      }
+    }
+    if (endOfProbe) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Returns the block of the name index holding an entry found by findName
+static int nameBlockOf(struct fs_name *entry) {
+  return ((char *)entry - nameCache) / blockSize;
+}
+
+// Checks that the disk is mounted and inumber is one of its inodes
+static bool checkInode(int inumber) {
+  if (freeInodesBitMap == NULL || inumber < 0 || inumber >= mountedSuper.ninodes) {
+    printf("error, inode doesn't exist\n");
+    return false;
+  }
+  return true;
+}
+
+// Checks that the disk is mounted with a name index and the name fits in it
+static bool checkName(const char *name) {
+  if (nameCached == NULL || mountedSuper.nnameblocks == 0) {
+    printf("error, disk is not mounted or has no name index\n");
+    return false;
+  }
+  if (name[0] == '\0' || strlen(name) >= NAME_LENGTH) {
+    printf("error, names must be 1 to %d characters\n", NAME_LENGTH - 1);
+    return false;
+  }
+  return true;
+}
+
+// Removes every name referring to a deleted inode
+static void unlinkInode(int inumber) {
+  for (int i = 0; i < mountedSuper.nnameblocks; i++) {
+    struct fs_name *names = nameBlock(i);
+    bool dirty = false;
+    for (int j = 0; j < namesPerBlock; j++) {
+      if (names[j].name[0] != '\0' && names[j].inumber == inumber) {
+        memset(names[j].name, 0, NAME_LENGTH);
+        names[j].inumber = -1;
+        dirty = true;
+      }
+    }
+    if (dirty) {
+      writeNameBlock(i);
+    }
+  }
+}
+
+static int linkName(const char *name, int inumber) {
+  if (!checkName(name)) {
+    return 0;
+  }
+  if (inumber < 0 || inumber >= mountedSuper.ninodes || freeInodesBitMap[inumber]) {
+    printf("error, inode doesn't exist\n");
+    return 0;
+  }
+  struct fs_name *unused;
+  if (findName(name, &unused) != NULL) {
+    printf("error, name already exists\n");
+    return 0;
+  }
+  if (unused == NULL) {
+    printf("error, name index is full\n");
+    return 0;
+  }
+  // mark the inode before the name goes in, so a name never outlives its file
+  union fs_block block;
+  int inodeBlock = 1 + inumber / inodesPerBlock;
+  disk_read(inodeBlock, block.data);
+  if (!(block.inode[inumber % inodesPerBlock].isvalid & FS_INODE_NAMED)) {
+    block.inode[inumber % inodesPerBlock].isvalid |= FS_INODE_NAMED;
+    disk_write(inodeBlock, block.data);
+  }
+  unused->inumber = inumber;
+  strncpy(unused->name, name, NAME_LENGTH);
+  writeNameBlock(nameBlockOf(unused));
+  return 1;
+}
+
+static int lookupName(const char *name) {
+  if (!checkName(name)) {
+    return -1;
+  }
+  struct fs_name *entry = findName(name, NULL);
+  return entry == NULL ? -1 : entry->inumber;
+}
+
+static int unlinkName(const char *name) {
+  if (!checkName(name)) {
+    return 0;
+  }
+  struct fs_name *entry = findName(name, NULL);
+  if (entry == NULL) {
+    printf("error, name doesn't exist\n");
+    return 0;
+  }
+  memset(entry->name, 0, NAME_LENGTH);
+  entry->inumber = -1;
+  writeNameBlock(nameBlockOf(entry));
+  return 1;
 }
 
 void fs_debug() {
@@ -94,14 +400,18 @@ void fs_debug() {
   printf("    %d blocks\n", block.super.nblocks);
   printf("    %d inode blocks\n", block.super.ninodeblocks);
   printf("    %d inodes\n", block.super.ninodes);
+  printf("    %d bytes per block\n", blockSize);
+  if (block.super.nnameblocks > 0) {
+    printf("    %d name index blocks at %d\n", block.super.nnameblocks, block.super.nameindex);
+  }
 
   for (int i = 1; i < 1 + totalInodeBlocks; i++) {
     printf("__inode block %d__\n", i);
     disk_read(i, block.data);
-    for (int j = 0; j < INODES_PER_BLOCK; j++) {
-      //printf("inode %d (isvalid = %d):\n", (i-1)*128+j, block.inode[j].isvalid);
-      if (block.inode[j].isvalid == 1) {
-        printf("inode %d:\n", (i-1)*128+j);
+    for (int j = 0; j < inodesPerBlock; j++) {
+      //printf("inode %d (isvalid = %d):\n", (i-1)*inodesPerBlock+j, block.inode[j].isvalid);
+      if (block.inode[j].isvalid != 0) {
+        printf("inode %d:\n", (i-1)*inodesPerBlock+j);
         printf("    size: %d bytes\n", block.inode[j].size);
         bool atLeastOne = false;
         for (int k = 0; k < POINTERS_PER_INODE; k++) {
@@ -121,10 +431,8 @@ void fs_debug() {
           printf("    indirect data blocks: ");
           union fs_block indirect;
           disk_read(block.inode[j].indirect, indirect.data);
-          for (int z = 0; z < POINTERS_PER_BLOCK; z++) {
-            if (indirect.pointers[z] != 0) {
-              printf(" %d", indirect.pointers[z]);
-            }
+          for (int z = nextPointer(indirect.pointers, 0); z < pointersPerBlock; z = nextPointer(indirect.pointers, z + 1)) {
+            printf(" %d", indirect.pointers[z]);
           }
           // printf("    indirect data blocks: %d %d %d ...\n", block.inode[j].indirect+1, block.inode[j].indirect+2, block.inode[j].indirect+3);
           printf("\n");
@@ -134,7 +442,7 @@ void fs_debug() {
   }
    disk_read(0, block.data);
    printf("__FreeInodeBitMap__\n");
-   for (int i = 0; i < block.super.ninodeblocks * INODES_PER_BLOCK; i++) {
+   for (int i = 0; i < block.super.ninodeblocks * inodesPerBlock; i++) {
      if (freeInodesBitMap[i]) {
       // printf("inode %d: Free\n", i);
      }
@@ -148,6 +456,9 @@ void fs_debug() {
     if (freeBlockBitMap[i]) {
       //printf("%d: Free\n", i+1+block.super.ninodeblocks);
     }
+    else if (blockRefCounts[i] > 1) {
+      printf("%d: In Use (shared by %d)\n", i+1+block.super.ninodeblocks, blockRefCounts[i]);
+    }
     else {
       printf("%d: In Use\n", i+1+block.super.ninodeblocks);
     }
@@ -155,29 +466,47 @@ void fs_debug() {
 }
 
 // DONE (?)
-int fs_format() {
+static int formatDisk(int size, bool names) {
+  int oldSize = blockSize;
+  if (!setBlockSize(size)) {
+    return 0;
+  }
+  if (disk_size() < 2 + 2 * NUM_INODE_BLOCKS(disk_size())) {
+    printf("error, disk is too small for %d byte blocks\n", size);
+    setBlockSize(oldSize);
+    return 0;
+  }
+
   // erase all data currently on disk
   union fs_block empty;
   // not sure if this is the way to create a empty block
-  for (int i = 0; i < DISK_BLOCK_SIZE; i++) {
+  for (int i = 0; i < blockSize; i++) {
     empty.data[i] = 0;
   }
   for (int i = 0; i < disk_size(); i++) {
     disk_write(i, empty.data);
   }
   union fs_block block;
+  memset(block.data, 0, blockSize);
 
   // put superblock info into disk
   block.super.magic = FS_MAGIC;
   block.super.nblocks = disk_size();
   block.super.ninodeblocks = NUM_INODE_BLOCKS(disk_size());
-  block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
+  block.super.ninodes = block.super.ninodeblocks * inodesPerBlock;
+  block.super.blocksize = blockSize;
+  // the name index follows the inodes and has room for a name per inode
+  if (names) {
+    block.super.nameindex = 1 + block.super.ninodeblocks;
+    block.super.nnameblocks = block.super.ninodeblocks;
+  }
+  block.super.namemarks = 1;
   disk_write(0, block.data);
   return 1;
 }
 
 // indirect still needs to be finished
-int fs_mount() {
+static int mountDisk() {
   // check that superblock is formatted
   union fs_block super;
   disk_read(0, super.data);
@@ -185,6 +514,10 @@ int fs_mount() {
     printf("superblock not initialized\n");
     return 0;
   }
+  if (!setBlockSize(super.super.blocksize == 0 ? DISK_BLOCK_SIZE : super.super.blocksize)) {
+    return 0;
+  }
+  mountedSuper = super.super;
 
   // create inodebitmap
   freeInodesBitMap = (bool*) malloc(super.super.ninodes * sizeof(bool));
@@ -199,6 +532,18 @@ int fs_mount() {
     printf("malloc error\n");
     return 0;
   }
+  blockRefCounts = (int*) calloc(super.super.nblocks - super.super.ninodeblocks - 1, sizeof(int));
+  if (blockRefCounts == NULL) {
+    printf("malloc error\n");
+    return 0;
+  }
+  freeInodeStack = (int*) malloc(super.super.ninodes * sizeof(int));
+  freeInodeSlot = (int*) malloc(super.super.ninodes * sizeof(int));
+  freeInodesInBlock = (int*) calloc(super.super.ninodeblocks, sizeof(int));
+  if (freeInodeStack == NULL || freeInodeSlot == NULL || freeInodesInBlock == NULL) {
+    printf("malloc error\n");
+    return 0;
+  }
 
   //initialize maps
   // start all data blocks as free
@@ -208,33 +553,58 @@ int fs_mount() {
   for (int i = 1; i <= super.super.ninodeblocks; i++) {
     union fs_block block;
     disk_read(i, block.data);
-    for (int j = 0; j < INODES_PER_BLOCK; j++) {
-      freeInodesBitMap[(i-1)*128+j] = (block.inode[j].isvalid == 0);
+    for (int j = 0; j < inodesPerBlock; j++) {
+      freeInodesBitMap[(i-1)*inodesPerBlock+j] = (block.inode[j].isvalid == 0);
       // inode is in use, check direct/indirect
-      if (!freeInodesBitMap[(i-1)*128+j]) {
+      if (!freeInodesBitMap[(i-1)*inodesPerBlock+j]) {
+        // pointers outside the data blocks are left for fs_fsck to report
         for (int k = 0; k < POINTERS_PER_INODE; k++) {
-          if (block.inode[j].direct[k] != 0) {
-            freeBlockBitMap[block.inode[j].direct[k] - super.super.ninodeblocks - 1] = false;
+          if (inDataRegion(block.inode[j].direct[k])) {
+            refBlock(block.inode[j].direct[k]);
           }
         }
-        if (block.inode[j].indirect != 0) {
-          freeBlockBitMap[block.inode[j].indirect - super.super.ninodeblocks - 1] = false;
-          // what other blocks does this include???
-          union fs_block indirect;
-          disk_read(block.inode[j].indirect, indirect.data);
-          for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
-            if (indirect.pointers[i] != 0) {
-              freeBlockBitMap[indirect.pointers[i] - super.super.ninodeblocks - 1] = false;
+        if (inDataRegion(block.inode[j].indirect)) {
+          // an indirect block shared by clones only holds one reference to
+          // each of its data blocks, so only count them on the first visit
+          bool firstVisit = blockRefCounts[blockIndex(block.inode[j].indirect)] == 0;
+          refBlock(block.inode[j].indirect);
+          if (firstVisit) {
+            union fs_block indirect;
+            disk_read(block.inode[j].indirect, indirect.data);
+            for (int i = nextPointer(indirect.pointers, 0); i < pointersPerBlock; i = nextPointer(indirect.pointers, i + 1)) {
+              if (inDataRegion(indirect.pointers[i])) {
+                refBlock(indirect.pointers[i]);
+              }
             }
           }
         }
       }
     }
   }
+
+  freeInodeCount = 0;
+  for (int i = super.super.ninodes - 1; i >= 0; i--) {
+    if (freeInodesBitMap[i]) {
+      freeInode(i);
+    }
+  }
+
+  // the name index lives in data blocks nothing else may use
+  for (int i = 0; i < super.super.nnameblocks; i++) {
+    if (inDataRegion(super.super.nameindex + i)) {
+      refBlock(super.super.nameindex + i);
+    }
+  }
+  nameCache = (char*) malloc((size_t)super.super.nnameblocks * blockSize);
+  nameCached = (bool*) calloc(super.super.nnameblocks, sizeof(bool));
+  if ((nameCache == NULL || nameCached == NULL) && super.super.nnameblocks > 0) {
+    printf("malloc error\n");
+    return 0;
+  }
   return 1;
 }
 
-int fs_unmount() {
+static int unmountDisk() {
     if (freeBlockBitMap == NULL) {
       printf("unmount error, blockbitmap already freed\n");
       return 0;
@@ -245,20 +615,33 @@ int fs_unmount() {
     }
     free(freeBlockBitMap);
     free(freeInodesBitMap);
+    free(blockRefCounts);
+    free(nameCache);
+    free(nameCached);
+    free(freeInodeStack);
+    free(freeInodeSlot);
+    free(freeInodesInBlock);
     freeBlockBitMap = NULL;
     freeInodesBitMap = NULL;
+    blockRefCounts = NULL;
+    nameCache = NULL;
+    nameCached = NULL;
+    freeInodeStack = NULL;
+    freeInodeSlot = NULL;
+    freeInodesInBlock = NULL;
+    freeInodeCount = 0;
     return 1;
 }
 
-int fs_create() {
-  int inodeNumber = findOpenINode();
+static int createFile() {
+  int inodeNumber = allocInode();
   if (inodeNumber == -1) {
     printf("fail, no free inodes");
     return -1;
   }
   union fs_block block;
-  int inodeBlock = 1 + inodeNumber / INODES_PER_BLOCK;
-  int inodePosition = inodeNumber % INODES_PER_BLOCK;
+  int inodeBlock = 1 + inodeNumber / inodesPerBlock;
+  int inodePosition = inodeNumber % inodesPerBlock;
   disk_read(inodeBlock, block.data);
   block.inode[inodePosition].isvalid = 1;
   block.inode[inodePosition].size = 0;
@@ -267,61 +650,190 @@ int fs_create() {
   }
   block.inode[inodePosition].indirect = 0;
   disk_write(inodeBlock, block.data);
-  freeInodesBitMap[inodeNumber] = false;
-  return inodePosition;
+  return inodeNumber;
 }
 
-int fs_delete(int inumber) {
-  int inodeBlock = 1 + inumber / INODES_PER_BLOCK;
-  int inodePosition = inumber % INODES_PER_BLOCK;
+static int compareInts(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// Picks the inode block to take the next of the remaining inodes of
+// createFiles from: a wholly free block while a block's worth remains, then the
+// fullest block that still has room for all of them, and otherwise the block
+// with the most free inodes
+static int pickInodeBlock(int remaining) {
+  int bestFit = -1;
+  int mostFree = -1;
+  for (int i = 0; i < mountedSuper.ninodeblocks; i++) {
+    int count = freeInodesInBlock[i];
+    if (count >= remaining && (bestFit == -1 || count < freeInodesInBlock[bestFit])) {
+      bestFit = i;
+    }
+    if (count > 0 && (mostFree == -1 || count > freeInodesInBlock[mostFree])) {
+      mostFree = i;
+    }
+  }
+  if (remaining >= inodesPerBlock || bestFit == -1) {
+    return mostFree;
+  }
+  return bestFit;
+}
+
+static int createFiles(int n, int *inumbers) {
+  if (n < 0 || n > freeInodeCount) {
+    printf("fail, not enough free inodes\n");
+    return -1;
+  }
+  for (int i = 0; i < n;) {
+    int inodeBlock = pickInodeBlock(n - i);
+    for (int j = inodeBlock * inodesPerBlock; i < n && j < (inodeBlock + 1) * inodesPerBlock; j++) {
+      if (freeInodesBitMap[j]) {
+        takeInode(j);
+        inumbers[i++] = j;
+      }
+    }
+  }
+  qsort(inumbers, n, sizeof(int), compareInts);
+
+  // group the new inodes by inode block so each block is written once, and
+  // only read if some of its inodes are already in use
   union fs_block block;
+  for (int i = 0; i < n;) {
+    int inodeBlock = 1 + inumbers[i] / inodesPerBlock;
+    int count = 0;
+    while (i + count < n && 1 + inumbers[i + count] / inodesPerBlock == inodeBlock) {
+      count++;
+    }
+    if (count == inodesPerBlock) {
+      memset(block.data, 0, blockSize);
+    } else {
+      disk_read(inodeBlock, block.data);
+    }
+    for (; count > 0; count--, i++) {
+      struct fs_inode *inode = &block.inode[inumbers[i] % inodesPerBlock];
+      memset(inode, 0, sizeof(struct fs_inode));
+      inode->isvalid = 1;
+    }
+    disk_write(inodeBlock, block.data);
+  }
+  return n;
+}
+
+static int cloneFile(int inumber) {
+  if (!checkInode(inumber)) {
+    return -1;
+  }
+  union fs_block block;
+  disk_read(1 + inumber / inodesPerBlock, block.data);
+  struct fs_inode source = block.inode[inumber % inodesPerBlock];
+  if (source.isvalid == 0) {
+    printf("error, inode doesn't exist\n");
+    return -1;
+  }
+  int inodeNumber = allocInode();
+  if (inodeNumber == -1) {
+    printf("fail, no free inodes");
+    return -1;
+  }
+
+  // share the data blocks and the indirect block itself, the data blocks the
+  // indirect block points to keep their single reference from it
+  // pointers outside the data blocks were never counted (see mountDisk), so
+  // they are left for fsck here and in the other callers of refBlock and
+  // unrefBlock
+  for (int i = 0; i < POINTERS_PER_INODE; i++) {
+    if (inDataRegion(source.direct[i])) {
+      refBlock(source.direct[i]);
+    }
+  }
+  if (inDataRegion(source.indirect)) {
+    refBlock(source.indirect);
+  }
+
+  // the names stay with the source
+  source.isvalid = 1;
+  int inodeBlock = 1 + inodeNumber / inodesPerBlock;
   disk_read(inodeBlock, block.data);
-  union fs_block super;
-  disk_read(0, super.data);
-  union fs_block empty;
-  for (int i = 0; i < DISK_BLOCK_SIZE; i++) {
-    empty.data[i] = 0;
+  block.inode[inodeNumber % inodesPerBlock] = source;
+  disk_write(inodeBlock, block.data);
+  return inodeNumber;
+}
+
+static int deleteFile(int inumber) {
+  if (!checkInode(inumber)) {
+    return 0;
   }
+  int inodeBlock = 1 + inumber / inodesPerBlock;
+  int inodePosition = inumber % inodesPerBlock;
+  union fs_block block;
+  disk_read(inodeBlock, block.data);
   if (block.inode[inodePosition].isvalid == 0) {
     printf("error, nothing to delete\n");
     return 0;
   }
+  bool named = mountedSuper.namemarks == 0 || (block.inode[inodePosition].isvalid & FS_INODE_NAMED);
   block.inode[inodePosition].isvalid = 0;
   block.inode[inodePosition].size = 0;
 
   // clear out direct array
   for (int i = 0; i < POINTERS_PER_INODE; i++) {
-    if (block.inode[inodePosition].direct[i] != 0) {
-      freeBlockBitMap[block.inode[inodePosition].direct[i] - super.super.ninodeblocks - 1] = true;
-      disk_write(block.inode[inodePosition].direct[i], empty.data);
-      block.inode[inodePosition].direct[i] = 0;
+    if (inDataRegion(block.inode[inodePosition].direct[i])) {
+      unrefBlock(block.inode[inodePosition].direct[i], false);
     }
+    block.inode[inodePosition].direct[i] = 0;
   }
 
   // clear out indirect
-  if (block.inode[inodePosition].indirect != 0) {
-    union fs_block indirect;
-    disk_read(block.inode[inodePosition].indirect, indirect.data);
-    for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
-      if (indirect.pointers[i] != 0) {
-        freeBlockBitMap[indirect.pointers[i]] = true;
-        disk_write(indirect.pointers[i], empty.data);
-      }
-    }
-    freeBlockBitMap[block.inode[inodePosition].indirect - super.super.ninodeblocks - 1] = true;
-    disk_write(block.inode[inodePosition].indirect, empty.data);
-    block.inode[inodePosition].indirect = 0;
+  if (inDataRegion(block.inode[inodePosition].indirect)) {
+    unrefBlock(block.inode[inodePosition].indirect, true);
   }
+  block.inode[inodePosition].indirect = 0;
   disk_write(inodeBlock, block.data);
-  freeInodesBitMap[inumber] = true;
+  freeInode(inumber);
+  if (named) {
+    unlinkInode(inumber);
+  }
   return 1;
 }
 
-int fs_getsize(int inumber) {
-  int inodeBlock = 1 + inumber / INODES_PER_BLOCK;
-  int inodePosition = inumber % INODES_PER_BLOCK;
+// fs_read, fs_getsize and fs_write share fsLock (see the public entry points),
+// which keeps every block they can reach allocated: a shared lock never frees
+// a block, since copy on write only drops a reference that a clone still
+// holds. metaLock serializes their use of the inodes, indirect blocks and
+// bitmaps, while the data blocks themselves are transferred outside it
+static pthread_mutex_t metaLock = PTHREAD_MUTEX_INITIALIZER;
+
+// A write publishes the new size and block pointers before its data reaches
+// the blocks, so it holds the lock of its inode exclusively until the data is
+// written, while reads and size queries hold it shared. This also keeps a
+// reader's copy of the block pointers current, so it never sees a clone's
+// in-place writes to a block its own file has since moved away from. Inodes
+// share the locks by number
+#define INODE_LOCKS 256
+static pthread_rwlock_t inodeLocks[INODE_LOCKS];
+static pthread_once_t inodeLocksOnce = PTHREAD_ONCE_INIT;
+
+static void initInodeLocks() {
+  for (int i = 0; i < INODE_LOCKS; i++) {
+    pthread_rwlock_init(&inodeLocks[i], NULL);
+  }
+}
+
+static pthread_rwlock_t *inodeLock(int inumber) {
+  pthread_once(&inodeLocksOnce, initInodeLocks);
+  return &inodeLocks[(unsigned)inumber % INODE_LOCKS];
+}
+
+static int fileSize(int inumber) {
+  if (!checkInode(inumber)) {
+    return -1;
+  }
+  int inodeBlock = 1 + inumber / inodesPerBlock;
+  int inodePosition = inumber % inodesPerBlock;
   union fs_block block;
+  pthread_mutex_lock(&metaLock);
   disk_read(inodeBlock, block.data);
+  pthread_mutex_unlock(&metaLock);
   if (block.inode[inodePosition].isvalid == 0) {
     printf("error, inode doesn't exist\n");
     return -1;
@@ -329,107 +841,1029 @@ int fs_getsize(int inumber) {
   return block.inode[inodePosition].size;
 }
 
-int fs_read(int inumber, char *data, int length, int offset) {
-  int inodeBlock = 1 + inumber / INODES_PER_BLOCK;
-  int inodePosition = inumber % INODES_PER_BLOCK;
+// Consecutive full blocks of a read or write that sit in consecutive blocks on
+// disk. They are transferred with one request so that a striped disk can
+// spread them over its files
+struct block_run
+{
+  int start;    // first block number
+  int count;    // number of blocks (0 if the run is empty)
+  char *data;   // buffer holding count * blockSize bytes
+};
+
+static void flushRun(struct block_run *run, bool isWrite) {
+  if (run->count == 0) {
+    return;
+  }
+  if (isWrite) {
+    disk_write_blocks(run->start, run->count, run->data);
+  } else {
+    disk_read_blocks(run->start, run->count, run->data);
+  }
+  run->count = 0;
+}
+
+// Adds a full block to the run, transferring the run first if the block does
+// not continue it
+static void addToRun(struct block_run *run, int blocknum, char *data, bool isWrite) {
+  if (run->count > 0 && blocknum == run->start + run->count) {
+    run->count++;
+    return;
+  }
+  flushRun(run, isWrite);
+  run->start = blocknum;
+  run->count = 1;
+  run->data = data;
+}
+
+// Adds a full block to the last of a list of runs, or starts a new run if the
+// block does not continue it. The list is transferred later by the caller
+static void appendRun(struct block_run *runs, int *nruns, int blocknum, char *data) {
+  if (*nruns > 0 && blocknum == runs[*nruns - 1].start + runs[*nruns - 1].count) {
+    runs[*nruns - 1].count++;
+    return;
+  }
+  runs[*nruns].start = blocknum;
+  runs[*nruns].count = 1;
+  runs[*nruns].data = data;
+  (*nruns)++;
+}
+
+// Copies the inode of a file about to be read, and its indirect block when the
+// range reaches it, so the data can be read without metaLock. length is cut
+// back to the end of the file, or to the first block that is missing.
+// Called with metaLock held. Returns 1 on success and 0 on failure
+static int mapRead(int inumber, int offset, int *length, struct fs_inode *inode, union fs_block *indirect) {
+  int inodeBlock = 1 + inumber / inodesPerBlock;
+  int inodePosition = inumber % inodesPerBlock;
   union fs_block block;
   disk_read(inodeBlock, block.data);
+  *inode = block.inode[inodePosition];
   // check that inode is valid
-  if (block.inode[inodePosition].isvalid == 0) {
+  if (inode->isvalid == 0) {
     printf("error, inode doesn't exist\n");
     return 0;
   }
   // check if inode has data at offset
-  if (offset > fs_getsize(inumber)) {
+  if (offset > inode->size) {
     printf("error, offset is larger then inode size\n");
     return 0;
   }
-  // not efficient to do it this one byte at a time, don't know how important that is
-  for (int i = 0; i < length; i++) {
-    // check if out of data to read
-    if (fs_getsize(inumber) < offset+i) {
-      //printf("ran out of data to read, returning early\n");
-      return i-1;
-    }
-    union fs_block blockData;
-    int dataBlock = (offset+i) / DISK_BLOCK_SIZE;   // the ith data block of this inode, not the actual data block position
-    int dataPosition = (offset+i) % DISK_BLOCK_SIZE;
-    //   dataBlock is in direct block
-    union fs_block super;
-    disk_read(0, super.data);
-    if (dataBlock < 5) {
-      // double check that this block is not free
-      if (freeBlockBitMap[block.inode[inodePosition].direct[dataBlock]-1-super.super.ninodeblocks]) {
-        printf("error, data block %d not initialized\n", block.inode[inodePosition].direct[dataBlock]);
-        return i;
-      }
-    disk_read(block.inode[inodePosition].direct[dataBlock], blockData.data);
-    data[i] = blockData.data[dataPosition];
+  // only read to the end of the file
+  if (*length > inode->size - offset) {
+    *length = inode->size - offset;
+  }
+
+  bool haveIndirect = false;
+  int first = offset >> blockShift;  // the ith data block of this inode, not the actual data block position
+  for (int dataBlock = first; *length > 0 && dataBlock <= (offset + *length - 1) >> blockShift; dataBlock++) {
+    int blocknum;
+    if (dataBlock < POINTERS_PER_INODE) {
+      blocknum = inode->direct[dataBlock];
     }
     // dataBlock is in indirect
     else {
       // double check that indirect block exists
-      if (block.inode[inodePosition].indirect == 0) {
+      if (!inDataRegion(inode->indirect)) {
         printf("error, indirect data block doesn't exist\n");
-        return i;
+        *length = dataBlock == first ? 0 : (dataBlock << blockShift) - offset;
+        break;
       }
-      union fs_block indirect;
-      disk_read(block.inode[inodePosition].indirect, indirect.data);
-      // double check that the pointer exists
-      if (indirect.pointers[dataBlock-5] == 0) {
-        printf("error, indirect pointer doesnt exist\n");
-        return i;
+      if (!haveIndirect) {
+        disk_read(inode->indirect, indirect->data);
+        haveIndirect = true;
       }
-      // checks that the data block that is pointed to is not free
-      if (freeBlockBitMap[indirect.pointers[dataBlock-5]-1-super.super.ninodeblocks]) {
-        printf("error, indirectly linked data block isn't initialized\n");
-        return i;
+      blocknum = indirect->pointers[dataBlock - POINTERS_PER_INODE];
+    }
+    // checks that the data block that is pointed to is initialized
+    if (!inDataRegion(blocknum) || freeBlockBitMap[blockIndex(blocknum)]) {
+      printf("error, data block %d not initialized\n", blocknum);
+      *length = dataBlock == first ? 0 : (dataBlock << blockShift) - offset;
+      break;
+    }
+  }
+  return 1;
+}
+
+static int readFile(int inumber, char *data, int length, int offset) {
+  if (!checkInode(inumber)) {
+    return 0;
+  }
+  if (offset < 0 || length < 0) {
+    printf("error, negative offset or length\n");
+    return 0;
+  }
+  struct fs_inode inode;
+  union fs_block indirect;
+  pthread_mutex_lock(&metaLock);
+  int mapped = mapRead(inumber, offset, &length, &inode, &indirect);
+  pthread_mutex_unlock(&metaLock);
+  if (!mapped) {
+    return 0;
+  }
+
+  struct block_run run = { 0, 0, NULL };
+  int bytesRead = 0;
+  while (bytesRead < length) {
+    int dataBlock = (offset+bytesRead) >> blockShift;
+    int dataPosition = (offset+bytesRead) & (blockSize - 1);
+    int chunk = blockSize - dataPosition;
+    if (chunk > length - bytesRead) {
+      chunk = length - bytesRead;
+    }
+    int blocknum = dataBlock < POINTERS_PER_INODE ? inode.direct[dataBlock] : indirect.pointers[dataBlock - POINTERS_PER_INODE];
+
+    if (chunk == blockSize) {
+      // whole blocks are read straight into the caller's buffer
+      addToRun(&run, blocknum, data + bytesRead, false);
+    } else {
+      union fs_block blockData;
+      disk_read(blocknum, blockData.data);
+      memcpy(data + bytesRead, blockData.data + dataPosition, chunk);
+    }
+    bytesRead += chunk;
+  }
+  flushRun(&run, false);
+  return bytesRead;
+}
+
+// Makes the block stored in *pointer private to the file being written,
+// allocating it if it is missing and moving it to a new block if it is shared
+// with a clone. indirect holds the current contents when the block is an
+// indirect block, since the copy takes its own reference to each data block.
+// The caller writes the new block. Returns 1 on success and 0 if the disk is full
+static int prepareWriteBlock(int *pointer, union fs_block *indirect) {
+  // a pointer outside the data blocks is replaced like a missing one
+  if (inDataRegion(*pointer) && blockRefCounts[blockIndex(*pointer)] == 1) {
+    return 1;
+  }
+  int newBlock = allocBlock();
+  if (newBlock == -1) {
+    printf("error, no free data blocks\n");
+    return 0;
+  }
+  if (inDataRegion(*pointer)) {
+    if (indirect != NULL) {
+      for (int i = nextPointer(indirect->pointers, 0); i < pointersPerBlock; i = nextPointer(indirect->pointers, i + 1)) {
+        if (inDataRegion(indirect->pointers[i])) {
+          refBlock(indirect->pointers[i]);
+        }
       }
-      disk_read(indirect.pointers[dataBlock-5], blockData.data);
-      data[i] = blockData.data[dataPosition];
     }
+    // still referenced by the clone, so this never frees the block
+    unrefBlock(*pointer, indirect != NULL);
   }
-  return length;
+  *pointer = newBlock;
+  return 1;
 }
-int fs_write(int inumber, const char *data, int length, int offset)
+
+static int writeFile(int inumber, const char *data, int length, int offset)
 {
-  int inodeBlock = 1 + inumber / INODES_PER_BLOCK;
-  int inodePosition = inumber % INODES_PER_BLOCK;
+  if (!checkInode(inumber)) {
+    return 0;
+  }
+  if (offset < 0 || length < 0) {
+    printf("error, negative offset or length\n");
+    return 0;
+  }
+  int inodeBlock = 1 + inumber / inodesPerBlock;
+  int inodePosition = inumber % inodesPerBlock;
+
+  // only write the bytes that fit in the max file size
+  int maxSize = (POINTERS_PER_INODE + pointersPerBlock) * blockSize;
+  if (offset <= maxSize && length > maxSize - offset) {
+    length = maxSize - offset;
+  }
+  // whole blocks are written straight from the caller's buffer once metaLock
+  // is released, in runs of consecutive blocks
+  struct block_run *runs = malloc((length / blockSize + 1) * sizeof(struct block_run));
+  if (runs == NULL) {
+    printf("error, out of memory\n");
+    return 0;
+  }
+  int nruns = 0;
 
+  pthread_mutex_lock(&metaLock);
   union fs_block block;
   disk_read(inodeBlock, block.data);
+  struct fs_inode *inode = &block.inode[inodePosition];
+  if (inode->isvalid == 0) {
+    printf("error, inode doesn't exist\n");
+    pthread_mutex_unlock(&metaLock);
+    free(runs);
+    return 0;
+  }
 
   //check that offset isn't greater than total size
-  if (offset > fs_getsize(inumber)) {
+  if (offset > inode->size) {
     printf("error, offset is larger then inode size\n");
+    pthread_mutex_unlock(&metaLock);
+    free(runs);
     return 0;
   }
 
-  for (int i = 0 ; i < length; i++) {
-    if (fs_getsize(inumber) < offset + i) {
-      return i - 1;
+  union fs_block indirect;
+  bool haveIndirect = false;
+  bool indirectDirty = false;
+  int bytesWritten = 0;
+  while (bytesWritten < length) {
+    int dataBlock = (offset+bytesWritten) >> blockShift;  // the ith data block of this inode, not the actual data block position
+    int dataPosition = (offset+bytesWritten) & (blockSize - 1);
+    int chunk = blockSize - dataPosition;
+    if (chunk > length - bytesWritten) {
+      chunk = length - bytesWritten;
     }
-    int dataBlock = (offset+i) / DISK_BLOCK_SIZE;   // the ith data block of this inode, not the actual data block position
-    int dataPosition = (offset+i) % DISK_BLOCK_SIZE;
-    union fs_block super;
-    union fs_block indirect;
-    
-    disk_read(0, super.data);
+
+    int *pointer;
     //direct block
-    if (dataBlock < 5) {
-      // double check that this block is not free
-      if (freeBlockBitMap[block.inode[inodePosition].direct[dataBlock]-1-super.super.ninodeblocks]) {
-        int newBlock = findOpenBlock();
-        block.inode[inodePosition].direct[dataBlock] = newBlock;
-        freeBlockBitMap[newBlock] = false;
-      }
-      disk_write(block.inode[inodePosition].direct[dataBlock], data);
+    if (dataBlock < POINTERS_PER_INODE) {
+      pointer = &inode->direct[dataBlock];
     } else { //indirect block
-        4; // not done yet
-      
+      if (!haveIndirect) {
+        if (!inDataRegion(inode->indirect)) {
+          memset(indirect.data, 0, blockSize);
+        } else {
+          disk_read(inode->indirect, indirect.data);
+        }
+        // a shared indirect block means its data blocks are shared as well,
+        // so it has to be copied before any of them are
+        int oldIndirect = inode->indirect;
+        if (!prepareWriteBlock(&inode->indirect, &indirect)) {
+          break;
+        }
+        indirectDirty = inode->indirect != oldIndirect;
+        haveIndirect = true;
+      }
+      pointer = &indirect.pointers[dataBlock - POINTERS_PER_INODE];
+    }
+
+    int oldBlock = *pointer;
+    union fs_block blockData;
+    if (chunk < blockSize) {
+      // partial block, keep the bytes around the written range
+      if (!inDataRegion(oldBlock)) {
+        memset(blockData.data, 0, blockSize);
+      } else {
+        disk_read(oldBlock, blockData.data);
+      }
+    }
+    if (!prepareWriteBlock(pointer, NULL)) {
+      break;
+    }
+    if (*pointer != oldBlock && dataBlock >= POINTERS_PER_INODE) {
+      indirectDirty = true;
+    }
+    if (chunk == blockSize) {
+      appendRun(runs, &nruns, *pointer, (char *)data + bytesWritten);
+    } else {
+      memcpy(blockData.data + dataPosition, data + bytesWritten, chunk);
+      disk_write(*pointer, blockData.data);
+    }
+    bytesWritten += chunk;
+  }
+
+  if (indirectDirty) {
+    disk_write(inode->indirect, indirect.data);
+  }
+  if (offset + bytesWritten > inode->size) {
+    inode->size = offset + bytesWritten;
+  }
+  disk_write(inodeBlock, block.data);
+  pthread_mutex_unlock(&metaLock);
+
+  // the blocks are allocated to this file now, and stay so while fsLock is
+  // held. Readers of this inode wait on its lock until they are written
+  for (int i = 0; i < nruns; i++) {
+    flushRun(&runs[i], true);
+  }
+  free(runs);
+  return bytesWritten;
+}
+
+// Collects the data blocks of an inode in the order a sequential read visits
+// them: the direct blocks, then the indirect block and the blocks it points
+// to. indirect is filled with the indirect block if the inode has one.
+// Returns the number of block numbers stored in blocks
+static int inodeLayout(struct fs_inode *inode, union fs_block *indirect, int *blocks) {
+  int count = 0;
+  for (int i = 0; i < POINTERS_PER_INODE; i++) {
+    if (inode->direct[i] != 0) {
+      blocks[count++] = inode->direct[i];
+    }
+  }
+  if (inode->indirect != 0) {
+    blocks[count++] = inode->indirect;
+  }
+  if (inDataRegion(inode->indirect)) {
+    disk_read(inode->indirect, indirect->data);
+    for (int i = nextPointer(indirect->pointers, 0); i < pointersPerBlock; i = nextPointer(indirect->pointers, i + 1)) {
+      blocks[count++] = indirect->pointers[i];
+    }
+  }
+  return count;
+}
+
+// Returns the number of places where the next block of a file is not the
+// physically next block on disk
+static int layoutBreaks(int *blocks, int count) {
+  int breaks = 0;
+  for (int i = 1; i < count; i++) {
+    if (blocks[i] != blocks[i-1] + 1) {
+      breaks++;
+    }
+  }
+  return breaks;
+}
+
+// Returns the first block number of a run of count free data blocks, or -1 if
+// there is no such run
+static int findOpenRun(int count) {
+  int runLength = 0;
+  for (int i = 0; i < mountedSuper.nblocks - mountedSuper.ninodeblocks - 1; i++) {
+    runLength = freeBlockBitMap[i] ? runLength + 1 : 0;
+    if (runLength == count) {
+      return i - count + 1 + mountedSuper.ninodeblocks + 1;
+    }
+  }
+  return -1;
+}
+
+double fs_fragmentation() {
+  if (freeBlockBitMap == NULL) {
+    printf("error, disk not mounted\n");
+    return -1;
+  }
+  int blocks[POINTERS_PER_INODE + 1 + pointersPerBlock];
+  int pairs = 0;
+  int breaks = 0;
+  for (int i = 1; i <= mountedSuper.ninodeblocks; i++) {
+    union fs_block block;
+    disk_read(i, block.data);
+    for (int j = 0; j < inodesPerBlock; j++) {
+      if (block.inode[j].isvalid != 0) {
+        union fs_block indirect;
+        int count = inodeLayout(&block.inode[j], &indirect, blocks);
+        if (count > 1) {
+          pairs += count - 1;
+          breaks += layoutBreaks(blocks, count);
+        }
+      }
+    }
+  }
+  return pairs == 0 ? 0 : 100.0 * breaks / pairs;
+}
+
+// Moves every block of an inode into the run of free blocks starting at start,
+// in layout order. The copies are written before the inode is, and the old
+// blocks are only freed once the inode points at the copies
+static void relocateInode(int inodeBlock, union fs_block *block, int inodePosition, union fs_block *indirect, int *blocks, int count, int start) {
+  struct fs_inode *inode = &block->inode[inodePosition];
+  for (int i = 0; i < count; i++) {
+    refBlock(start + i);
+  }
+
+  int next = start;
+  union fs_block blockData;
+  for (int i = 0; i < POINTERS_PER_INODE; i++) {
+    if (inode->direct[i] != 0) {
+      disk_read(inode->direct[i], blockData.data);
+      disk_write(next, blockData.data);
+      inode->direct[i] = next++;
+    }
+  }
+  if (inode->indirect != 0) {
+    inode->indirect = next++;
+    for (int i = nextPointer(indirect->pointers, 0); i < pointersPerBlock; i = nextPointer(indirect->pointers, i + 1)) {
+      disk_read(indirect->pointers[i], blockData.data);
+      disk_write(next, blockData.data);
+      indirect->pointers[i] = next++;
+    }
+    disk_write(inode->indirect, indirect->data);
+  }
+  disk_write(inodeBlock, block->data);
+
+  // the pointers to the old blocks are gone, so free them one at a time
+  // rather than letting the old indirect block drop its entries
+  for (int i = 0; i < count; i++) {
+    unrefBlock(blocks[i], false);
+  }
+}
+
+static int defragDisk() {
+  if (freeBlockBitMap == NULL) {
+    printf("error, disk not mounted\n");
+    return -1;
+  }
+  int blocks[POINTERS_PER_INODE + 1 + pointersPerBlock];
+  int moved = 0;
+  // a file can move again on a later pass, count each one once
+  bool *movedInodes = calloc(mountedSuper.ninodes, sizeof(bool));
+  if (movedInodes == NULL) {
+    printf("malloc error\n");
+    return -1;
+  }
+  // moving a file frees its old blocks, which can open up a run for a file
+  // that did not fit before, so repeat until nothing moves. Files only move
+  // when they are fragmented or to a lower run, so this terminates
+  bool movedAny = true;
+  while (movedAny) {
+    movedAny = false;
+    for (int i = 1; i <= mountedSuper.ninodeblocks; i++) {
+      union fs_block block;
+      disk_read(i, block.data);
+      for (int j = 0; j < inodesPerBlock; j++) {
+        if (block.inode[j].isvalid == 0) {
+          continue;
+        }
+        union fs_block indirect;
+        int count = inodeLayout(&block.inode[j], &indirect, blocks);
+        if (count == 0) {
+          continue;
+        }
+        // blocks shared with a clone would have to be repointed in every
+        // file using them, leave them where they are, and files pointing
+        // outside the data blocks for fsck
+        bool shared = false;
+        for (int k = 0; k < count; k++) {
+          if (!inDataRegion(blocks[k]) || blockRefCounts[blockIndex(blocks[k])] > 1) {
+            shared = true;
+          }
+        }
+        if (shared) {
+          continue;
+        }
+        int start = findOpenRun(count);
+        if (start == -1) {
+          continue;
+        }
+        if (layoutBreaks(blocks, count) == 0 && start > blocks[0]) {
+          continue;
+        }
+        relocateInode(i, &block, j, &indirect, blocks, count, start);
+        int inumber = (i - 1) * inodesPerBlock + j;
+        moved += !movedInodes[inumber];
+        movedInodes[inumber] = true;
+        movedAny = true;
+      }
+    }
+  }
+  free(movedInodes);
+  return moved;
+}
+
+// Kinds of problems reported by fs_fsck
+enum fsck_problem
+{
+  FSCK_BAD_SIZE,          // size is negative or larger than the max file size
+  FSCK_OUT_OF_RANGE,      // pointer outside of the data blocks
+  FSCK_CROSS_LINKED,      // block used by another inode for a different purpose
+  FSCK_HOLE,              // missing block inside the file size
+  FSCK_BEYOND_SIZE,       // block allocated past the end of the file
+  FSCK_SIZE_MISMATCH,     // size covers blocks that are missing or invalid
+  FSCK_INODE_BITMAP,      // freeInodesBitMap disagrees with the inode
+  FSCK_BLOCK_BITMAP,      // freeBlockBitMap disagrees with the references
+  FSCK_REFCOUNT,          // blockRefCounts disagrees with the references
+};
+
+static const char *fsckProblemNames[] = {
+  "bad-size", "out-of-range", "cross-linked", "hole", "beyond-size",
+  "size-mismatch", "inode-bitmap", "block-bitmap", "refcount",
+};
+
+struct fsck_finding
+{
+  int problem;  // enum fsck_problem
+  int inumber;  // inode the problem was found in (-1 if none)
+  int slot;     // logical block of the pointer, -1 for the indirect pointer
+  int block;    // block number involved (0 if none)
+  int value;    // size the inode is repaired to for size problems
+};
+
+// Inode blocks read by one fsck thread and the problems found in them. The
+// thread copies out the pointers of every valid inode, which are checked once
+// all threads are done
+struct fsck_scan
+{
+  int firstInodeBlock;
+  int lastInodeBlock;
+  int *records;       // FSCK_RECORD_LENGTH ints per inode, then its indirect block if read
+  size_t nrecords;
+  size_t recordCapacity;
+  struct fsck_finding *findings;
+  int nfindings;
+  int capacity;
+  bool outOfMemory;   // a finding or record was dropped, so the results are incomplete
+};
+
+// inumber, size, direct pointers, indirect pointer and whether the indirect
+// block follows
+#define FSCK_RECORD_LENGTH (POINTERS_PER_INODE + 4)
+
+static uint64_t *fsckValidInodes;    // bitset of inodes marked valid on disk, set atomically
+static int *fsckRefs;                // references found to each data block
+static unsigned short *fsckRoles;    // slot + 2 of the first reference to each data block
+
+// Role of the name index blocks, which no inode slot can share
+#define FSCK_ROLE_NAME_INDEX 0xffff
+
+static void fsckReport(struct fsck_scan *scan, int problem, int inumber, int slot, int block, int value) {
+  if (scan->nfindings == scan->capacity) {
+    int capacity = scan->capacity ? scan->capacity * 2 : 16;
+    struct fsck_finding *findings = realloc(scan->findings, capacity * sizeof(struct fsck_finding));
+    if (findings == NULL) {
+      scan->outOfMemory = true;
+      return;
+    }
+    scan->findings = findings;
+    scan->capacity = capacity;
+  }
+  struct fsck_finding finding = { problem, inumber, slot, block, value };
+  scan->findings[scan->nfindings++] = finding;
+}
+
+static void fsckRecord(struct fsck_scan *scan, const int *values, int count) {
+  if (scan->outOfMemory) {
+    return;
+  }
+  if (scan->nrecords + count > scan->recordCapacity) {
+    size_t capacity = scan->recordCapacity;
+    while (scan->nrecords + count > capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+    }
+    int *records = realloc(scan->records, capacity * sizeof(int));
+    if (records == NULL) {
+      scan->outOfMemory = true;
+      return;
+    }
+    scan->records = records;
+    scan->recordCapacity = capacity;
+  }
+  memcpy(scan->records + scan->nrecords, values, count * sizeof(int));
+  scan->nrecords += count;
+}
+
+// Records a reference to blocknum from the given slot. Clones share blocks in
+// the same slot, a block referenced from a different slot is cross-linked.
+// Inodes are checked in order, so the lowest numbered inode using a
+// cross-linked block keeps it.
+// Returns 0 if the block is cross-linked, otherwise 1 with *first set if this
+// is the first reference to the block
+static int fsckClaim(int blocknum, int slot, bool *first) {
+  int index = blockIndex(blocknum);
+  unsigned short role = slot + 2;
+  if (fsckRoles[index] != 0 && fsckRoles[index] != role) {
+    return 0;
+  }
+  fsckRoles[index] = role;
+  *first = fsckRefs[index]++ == 0;
+  return 1;
+}
+
+// Checks one pointer of an inode. needed is the number of blocks the size
+// covers and is lowered to the first missing or invalid block
+static void fsckPointer(struct fsck_scan *scan, int inumber, int slot, int blocknum, bool claim, int *needed) {
+  if (blocknum == 0) {
+    if (slot < *needed) {
+      fsckReport(scan, FSCK_HOLE, inumber, slot, 0, 0);
+      *needed = slot;
+    }
+    return;
+  }
+  bool first;
+  if (!inDataRegion(blocknum)) {
+    fsckReport(scan, FSCK_OUT_OF_RANGE, inumber, slot, blocknum, 0);
+  } else if (claim && !fsckClaim(blocknum, slot, &first)) {
+    fsckReport(scan, FSCK_CROSS_LINKED, inumber, slot, blocknum, 0);
+  } else {
+    if (slot >= *needed) {
+      fsckReport(scan, FSCK_BEYOND_SIZE, inumber, slot, blocknum, 0);
+    }
+    return;
+  }
+  // the pointer is cleared on repair, so the file ends here
+  if (slot < *needed) {
+    *needed = slot;
+  }
+}
+
+// Checks one inode. pointers is the content of its indirect block, or NULL if
+// the indirect pointer is outside of the data blocks
+static void fsckInode(struct fsck_scan *scan, int inumber, struct fs_inode *inode, const int *pointers) {
+  int maxSize = (POINTERS_PER_INODE + pointersPerBlock) * blockSize;
+  int size = inode->size;
+  if (size < 0 || size > maxSize) {
+    size = size < 0 ? 0 : maxSize;
+    fsckReport(scan, FSCK_BAD_SIZE, inumber, -1, 0, size);
+  }
+  int needed = (size + blockSize - 1) / blockSize;
+
+  for (int i = 0; i < POINTERS_PER_INODE; i++) {
+    fsckPointer(scan, inumber, i, inode->direct[i], true, &needed);
+  }
+
+  bool first;
+  if (inode->indirect == 0) {
+    if (needed > POINTERS_PER_INODE) {
+      fsckReport(scan, FSCK_HOLE, inumber, POINTERS_PER_INODE, 0, 0);
+      needed = POINTERS_PER_INODE;
+    }
+  } else if (!inDataRegion(inode->indirect) || !fsckClaim(inode->indirect, -1, &first)) {
+    bool inRange = inDataRegion(inode->indirect);
+    fsckReport(scan, inRange ? FSCK_CROSS_LINKED : FSCK_OUT_OF_RANGE, inumber, -1, inode->indirect, 0);
+    // the pointer is cleared on repair, so the file ends at the direct blocks
+    if (needed > POINTERS_PER_INODE) {
+      needed = POINTERS_PER_INODE;
+    }
+  } else {
+    if (needed <= POINTERS_PER_INODE) {
+      fsckReport(scan, FSCK_BEYOND_SIZE, inumber, -1, inode->indirect, 0);
+    }
+    // a shared indirect block is checked for every inode using it, but the
+    // blocks it points to are only referenced from it once
+    for (int i = 0; i < pointersPerBlock; i++) {
+      fsckPointer(scan, inumber, POINTERS_PER_INODE + i, pointers[i], first, &needed);
     }
+  }
+
+  if (needed * blockSize < size) {
+    fsckReport(scan, FSCK_SIZE_MISMATCH, inumber, -1, 0, needed * blockSize);
+  }
+}
 
+static void *fsckThread(void *arg) {
+  struct fsck_scan *scan = arg;
+  for (int i = scan->firstInodeBlock; i <= scan->lastInodeBlock; i++) {
+    union fs_block block;
+    disk_read(i, block.data);
+    for (int j = 0; j < inodesPerBlock; j++) {
+      struct fs_inode *inode = &block.inode[j];
+      if (inode->isvalid == 0) {
+        continue;
+      }
+      int inumber = (i-1)*inodesPerBlock+j;
+      __atomic_fetch_or(&fsckValidInodes[inumber / 64], (uint64_t)1 << (inumber % 64), __ATOMIC_RELAXED);
+      bool haveIndirect = inDataRegion(inode->indirect);
+      int record[FSCK_RECORD_LENGTH] = { inumber, inode->size };
+      memcpy(&record[2], inode->direct, sizeof(inode->direct));
+      record[POINTERS_PER_INODE + 2] = inode->indirect;
+      record[POINTERS_PER_INODE + 3] = haveIndirect;
+      fsckRecord(scan, record, FSCK_RECORD_LENGTH);
+      if (haveIndirect) {
+        union fs_block indirect;
+        disk_read(inode->indirect, indirect.data);
+        fsckRecord(scan, indirect.pointers, pointersPerBlock);
+      }
+    }
   }
+  return NULL;
+}
+
+// Repairs a problem found in an inode by clearing the bad pointer or fixing
+// the size
+static void fsckRepair(struct fsck_finding *finding) {
+  int inodeBlock = 1 + finding->inumber / inodesPerBlock;
+  union fs_block block;
+  disk_read(inodeBlock, block.data);
+  struct fs_inode *inode = &block.inode[finding->inumber % inodesPerBlock];
+  if (finding->problem == FSCK_BAD_SIZE || finding->problem == FSCK_SIZE_MISMATCH) {
+    inode->size = finding->value;
+  } else if (finding->slot == -1) {
+    inode->indirect = 0;
+  } else if (finding->slot < POINTERS_PER_INODE) {
+    inode->direct[finding->slot] = 0;
+  } else if (inode->indirect != 0) {
+    union fs_block indirect;
+    disk_read(inode->indirect, indirect.data);
+    indirect.pointers[finding->slot - POINTERS_PER_INODE] = 0;
+    disk_write(inode->indirect, indirect.data);
+  }
+  disk_write(inodeBlock, block.data);
+}
+
+// Returns true, after saying so, if a scan ran out of memory
+static bool fsckOutOfMemory(struct fsck_scan *scans, int nscans) {
+  for (int t = 0; t < nscans; t++) {
+    if (scans[t].outOfMemory) {
+      printf("error, out of memory during fsck\n");
+      return true;
+    }
+  }
+  return false;
+}
+static void fsckFree(struct fsck_scan *scans, int nscans, pthread_t *threads) {
+  for (int t = 0; t < nscans; t++) {
+    free(scans[t].records);
+    free(scans[t].findings);
+  }
+  free(scans);
+  free(threads);
+  free(fsckValidInodes);
+  free(fsckRefs);
+  free(fsckRoles);
+}
+static int checkDisk(int repair) {
+  if (freeBlockBitMap == NULL) {
+    printf("error, disk not mounted\n");
+    return -1;
+  }
+  int ndatablocks = mountedSuper.nblocks - mountedSuper.ninodeblocks - 1;
+  fsckValidInodes = calloc((mountedSuper.ninodes + 63) / 64, sizeof(uint64_t));
+  fsckRefs = calloc(ndatablocks, sizeof(int));
+  fsckRoles = calloc(ndatablocks, sizeof(unsigned short));
+  if (fsckValidInodes == NULL || fsckRefs == NULL || fsckRoles == NULL) {
+    printf("malloc error\n");
+    free(fsckValidInodes);
+    free(fsckRefs);
+    free(fsckRoles);
+    return -1;
+  }
+
+  // the name index blocks are referenced by the superblock
+  for (int i = 0; i < mountedSuper.nnameblocks; i++) {
+    if (inDataRegion(mountedSuper.nameindex + i)) {
+      fsckRefs[blockIndex(mountedSuper.nameindex + i)] = 1;
+      fsckRoles[blockIndex(mountedSuper.nameindex + i)] = FSCK_ROLE_NAME_INDEX;
+    }
+  }
+
+  // split the inode blocks between one thread per processor
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > mountedSuper.ninodeblocks) {
+    nthreads = mountedSuper.ninodeblocks;
+  }
+  struct fsck_scan *scans = calloc(nthreads + 1, sizeof(struct fsck_scan));
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  if (scans == NULL || threads == NULL) {
+    printf("malloc error\n");
+    fsckFree(scans, 0, threads);
+    return -1;
+  }
+  for (int t = 0; t < nthreads; t++) {
+    scans[t].firstInodeBlock = 1 + t * mountedSuper.ninodeblocks / nthreads;
+    scans[t].lastInodeBlock = (t + 1) * mountedSuper.ninodeblocks / nthreads;
+    if (pthread_create(&threads[t], NULL, fsckThread, &scans[t]) != 0) {
+      // scan this range on the current thread instead
+      threads[t] = 0;
+      fsckThread(&scans[t]);
+    }
+  }
+  for (int t = 0; t < nthreads; t++) {
+    if (threads[t] != 0) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+
+  // check the inodes in order so that findings don't depend on which thread
+  // got to a cross-linked block first
+  if (fsckOutOfMemory(scans, nthreads)) {
+    fsckFree(scans, nthreads + 1, threads);
+    return -1;
+  }
+  for (int t = 0; t < nthreads; t++) {
+    size_t pos = 0;
+    while (pos < scans[t].nrecords) {
+      const int *record = scans[t].records + pos;
+      struct fs_inode inode = { 1, record[1] };
+      memcpy(inode.direct, &record[2], sizeof(inode.direct));
+      inode.indirect = record[POINTERS_PER_INODE + 2];
+      bool haveIndirect = record[POINTERS_PER_INODE + 3];
+      pos += FSCK_RECORD_LENGTH;
+      fsckInode(&scans[t], record[0], &inode, haveIndirect ? scans[t].records + pos : NULL);
+      if (haveIndirect) {
+        pos += pointersPerBlock;
+      }
+    }
+    free(scans[t].records);
+    scans[t].records = NULL;
+  }
+
+  // cross-check the in-memory maps against what is on disk
+  struct fsck_scan *maps = &scans[nthreads];
+  int ninodes = 0;
+  for (int i = 0; i < mountedSuper.ninodes; i++) {
+    bool valid = (fsckValidInodes[i / 64] >> (i % 64)) & 1;
+    ninodes += valid;
+    if (freeInodesBitMap[i] == valid) {
+      fsckReport(maps, FSCK_INODE_BITMAP, i, -1, 0, 0);
+    }
+  }
+  int nused = 0;
+  int nshared = 0;
+  for (int i = 0; i < ndatablocks; i++) {
+    int blocknum = i + mountedSuper.ninodeblocks + 1;
+    nused += fsckRefs[i] > 0;
+    nshared += fsckRefs[i] > 1;
+    if (freeBlockBitMap[i] != (fsckRefs[i] == 0)) {
+      fsckReport(maps, FSCK_BLOCK_BITMAP, -1, -1, blocknum, fsckRefs[i]);
+    } else if (blockRefCounts[i] != fsckRefs[i]) {
+      fsckReport(maps, FSCK_REFCOUNT, -1, -1, blocknum, fsckRefs[i]);
+    }
+  }
+
+  // a partial list of findings is not repaired
+  if (fsckOutOfMemory(scans, nthreads + 1)) {
+    fsckFree(scans, nthreads + 1, threads);
+    return -1;
+  }
+  int problems = 0;
+  for (int t = 0; t <= nthreads; t++) {
+    for (int i = 0; i < scans[t].nfindings; i++) {
+      struct fsck_finding *finding = &scans[t].findings[i];
+      printf("fsck: problem=%s inode=%d slot=%d block=%d value=%d\n",
+             fsckProblemNames[finding->problem], finding->inumber, finding->slot, finding->block, finding->value);
+      problems++;
+      if (repair && finding->inumber >= 0 && finding->problem != FSCK_INODE_BITMAP && finding->problem != FSCK_HOLE) {
+        fsckRepair(finding);
+      }
+    }
+  }
+  printf("fsck: summary inodes=%d blocks=%d shared=%d problems=%d repaired=%d threads=%d\n",
+         ninodes, nused, nshared, problems, repair ? problems : 0, nthreads);
+  fsckFree(scans, nthreads + 1, threads);
+
+  // the maps are rebuilt from the repaired inodes, which also fixes any
+  // problems with the maps themselves and any holes the size repairs cut off
+  if (repair && problems > 0) {
+    unmountDisk();
+    if (!mountDisk()) {
+      printf("error, couldn't mount the disk again after the repair\n");
+      return -1;
+    }
+  }
+  return problems;
+}
+
+// Public entry points. Each call is recorded to the trace when one is open.
+// fs_read, fs_getsize and fs_write only take the shared side, so any number of
+// them can run at once, with their data transfers overlapping (see metaLock);
+// every other call has the file system to itself
+static pthread_rwlock_t fsLock = PTHREAD_RWLOCK_INITIALIZER;
+
+int fs_format() {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = formatDisk(DISK_BLOCK_SIZE, false);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_FORMAT, start, -1, 0, DISK_BLOCK_SIZE, result, NULL, NULL);
+  return result;
+}
+
+int fs_format_block_size(int size) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = formatDisk(size, false);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_FORMAT, start, -1, 0, size, result, NULL, NULL);
+  return result;
+}
+
+int fs_format_names(int size) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = formatDisk(size, true);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_FORMAT, start, -1, 1, size, result, NULL, NULL);
+  return result;
+}
+
+int fs_mount() {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = mountDisk();
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_MOUNT, start, -1, 0, 0, result, NULL, NULL);
+  return result;
+}
+
+int fs_unmount() {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = unmountDisk();
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_UNMOUNT, start, -1, 0, 0, result, NULL, NULL);
+  return result;
+}
+
+int fs_create() {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = createFile();
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_CREATE, start, -1, 0, 0, result, NULL, NULL);
+  return result;
+}
+
+int fs_create_many(int n, int *inumbers) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = createFiles(n, inumbers);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_CREATE_MANY, start, -1, 0, n, result, NULL, inumbers);
+  return result;
+}
+
+int fs_clone(int inumber) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = cloneFile(inumber);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_CLONE, start, inumber, 0, 0, result, NULL, NULL);
+  return result;
+}
+
+int fs_delete(int inumber) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = deleteFile(inumber);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_DELETE, start, inumber, 0, 0, result, NULL, NULL);
+  return result;
+}
+
+int fs_getsize(int inumber) {
+  long long start = trace_now();
+  pthread_rwlock_rdlock(&fsLock);
+  pthread_rwlock_rdlock(inodeLock(inumber));
+  int result = fileSize(inumber);
+  pthread_rwlock_unlock(inodeLock(inumber));
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_GETSIZE, start, inumber, 0, 0, result, NULL, NULL);
+  return result;
+}
+
+int fs_read(int inumber, char *data, int length, int offset) {
+  long long start = trace_now();
+  pthread_rwlock_rdlock(&fsLock);
+  pthread_rwlock_rdlock(inodeLock(inumber));
+  int result = readFile(inumber, data, length, offset);
+  pthread_rwlock_unlock(inodeLock(inumber));
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_READ, start, inumber, offset, length, result, NULL, NULL);
+  return result;
+}
+
+int fs_write(int inumber, const char *data, int length, int offset) {
+  long long start = trace_now();
+  pthread_rwlock_rdlock(&fsLock);
+  pthread_rwlock_wrlock(inodeLock(inumber));
+  int result = writeFile(inumber, data, length, offset);
+  pthread_rwlock_unlock(inodeLock(inumber));
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_WRITE, start, inumber, offset, length, result, NULL, NULL);
+  return result;
+}
+
+int fs_link(const char *name, int inumber) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = linkName(name, inumber);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_LINK, start, inumber, 0, 0, result, name, NULL);
+  return result;
+}
+
+int fs_lookup(const char *name) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = lookupName(name);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_LOOKUP, start, -1, 0, 0, result, name, NULL);
+  return result;
+}
+
+int fs_unlink(const char *name) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = unlinkName(name);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_UNLINK, start, -1, 0, 0, result, name, NULL);
+  return result;
+}
+
+int fs_has_names() {
+  pthread_rwlock_rdlock(&fsLock);
+  int result = nameCached != NULL && mountedSuper.nnameblocks > 0;
+  pthread_rwlock_unlock(&fsLock);
+  return result;
+}
+
+int fs_defrag() {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = defragDisk();
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_DEFRAG, start, -1, 0, 0, result, NULL, NULL);
+  return result;
+}
 
-  return length;
+int fs_fsck(int repair) {
+  long long start = trace_now();
+  pthread_rwlock_wrlock(&fsLock);
+  int result = checkDisk(repair);
+  pthread_rwlock_unlock(&fsLock);
+  trace_record(TRACE_FSCK, start, -1, 0, repair, result, NULL, NULL);
+  return result;
 }
@@ -1,6 +1,9 @@
 #ifndef FS_H
 #define FS_H
 
+// The fs_* calls below may be made from several threads at once. fs_debug and
+// fs_fragmentation must not run alongside them
+
 // Print debug information about the file system. Also a great location to
 // assert file system invariants
 void fs_debug();
@@ -9,6 +12,19 @@ void fs_debug();
 // Returns 1 on success and 0 on failure
 int fs_format();
 
+// Format the file system with blocks of the given size in bytes, which must be
+// a power of two from 1024 to 65536. The size is recorded in the superblock
+// and used by the disk from then on
+// Returns 1 on success and 0 on failure
+int fs_format_block_size(int size);
+
+// Format like fs_format_block_size and also reserve a name index for fs_link,
+// which takes as many blocks as the inodes do. Files that are given a name are
+// marked in their inode (isvalid 3), which builds that only accept isvalid 1,
+// such as simplefs-solution, don't see as files
+// Returns 1 on success and 0 on failure
+int fs_format_names(int size);
+
 // Mount the file system by initializing the freemap based on the current state
 // of the disk
 // Returns 1 on success and 0 on failure
@@ -22,6 +38,20 @@ int fs_unmount();
 // Returns newly allocated inode number (>= 0) on success and -1 on failure
 int fs_create();
 
+// Create n empty files, storing their inode numbers in ascending order in
+// inumbers, which must have room for n entries. The inodes fill wholly free
+// inode blocks first, which are written without being read, and the rest go
+// in the fullest inode block with room for them. Each inode block is written
+// once
+// Returns n on success and -1 on failure, in which case no files are created
+int fs_create_many(int n, int *inumbers);
+
+// Create a copy-on-write clone of the file given by the specified inode number.
+// The clone shares the source's data and indirect blocks, which are only copied
+// once either file writes to them
+// Returns newly allocated inode number (>= 0) on success and -1 on failure
+int fs_clone(int inumber);
+
 // Delete the file given by the specified inode number
 // Returns 1 on success and 0 on failure
 int fs_delete(int inumber);
@@ -39,8 +69,51 @@ int fs_read(int inumber, char *data, int length, int offset);
 
 // Write length bytes of the data buffer provided to the file specified by
 // inumber at offset. If length+offset goes beyond the max length of a file
-// then only write the bytes that fit given the max file size
+// then only write the bytes that fit given the max file size. Writes to
+// different files run alongside each other and alongside reads of other files,
+// with only the block allocation and inode update serialized. A file being
+// written is not read or written by anyone else until the write is done
 // Returns bytes written (> 0) on success and 0 on failure
 int fs_write(int inumber, const char *data, int length, int offset);
 
+// Add a name for the file given by the specified inode number to the name index.
+// Names are 1 to 27 characters long. Deleting a file removes its names, which
+// reads and searches the whole index, while deleting a file without names
+// doesn't touch it. Fails on disks formatted without a name index
+// Returns 1 on success and 0 on failure
+int fs_link(const char *name, int inumber);
+
+// Look up a name in the name index, which costs at most one block read for
+// names that have not been used since the disk was mounted
+// Returns the inode number (>= 0) on success and -1 if the name doesn't exist
+int fs_lookup(const char *name);
+
+// Remove a name from the name index
+// Returns 1 on success and 0 on failure
+int fs_unlink(const char *name);
+
+// Returns 1 if the mounted disk has a name index and 0 if it has none or no
+// disk is mounted. Disks formatted before the index was added have none
+int fs_has_names();
+
+// Returns the percentage of consecutive block pairs within files that are not
+// physically adjacent on disk (0 means every file is contiguous), or -1 if the
+// disk is not mounted
+double fs_fragmentation();
+
+// Relocate the blocks of each file into a contiguous run of free blocks and
+// compact files towards the start of the data region. Files sharing blocks
+// with a clone are left in place
+// Returns the number of files moved (>= 0) on success and -1 on failure
+int fs_defrag();
+
+// Check the consistency of the mounted file system. The inode blocks are
+// scanned in parallel, checking pointer ranges, blocks used by more than one
+// inode in different places, sizes that disagree with the allocated blocks,
+// and the in-memory bitmaps. Each problem is printed as a line of key=value
+// pairs followed by a summary line. If repair is nonzero bad pointers are
+// cleared, sizes are cut back to the valid blocks and the bitmaps are rebuilt
+// Returns the number of problems found (>= 0) on success and -1 on failure
+int fs_fsck(int repair);
+
 #endif
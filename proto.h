@@ -0,0 +1,40 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+
+// Binary protocol spoken between simplefs-server and its clients over a Unix
+// domain socket. Both ends are on the same machine, so values are in native
+// byte order. A client may send any number of requests without waiting, the
+// server answers every request on a connection in the order it was sent
+
+#define PROTO_MAX_LENGTH (1 << 20)  // largest read or write in one request
+
+enum proto_op
+{
+    PROTO_CREATE,
+    PROTO_DELETE,
+    PROTO_GETSIZE,
+    PROTO_READ,
+    PROTO_WRITE,
+};
+
+// Followed by length bytes of data for PROTO_WRITE
+struct proto_request
+{
+    uint32_t id;        // echoed back in the response
+    int32_t op;         // enum proto_op
+    int32_t inumber;
+    int32_t offset;
+    int32_t length;
+};
+
+// Followed by length bytes of data for PROTO_READ
+struct proto_response
+{
+    uint32_t id;
+    int32_t result;     // value the fs_* call returned
+    int32_t length;
+};
+
+#endif
@@ -0,0 +1,242 @@
+#include "fs.h"
+#include "disk.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Inode numbers in the trace mapped to the ones created by the replay, -1 if
+// the trace number has not been seen
+static int *inodemap;
+static int inodemapsize;
+
+static int map_inode(int inumber)
+{
+    if (inumber >= 0 && inumber < inodemapsize && inodemap[inumber] >= 0)
+        return inodemap[inumber];
+
+    return inumber;
+}
+
+static void remember_inode(int traced, int actual)
+{
+    if (traced < 0 || actual < 0)
+        return;
+
+    if (traced >= inodemapsize)
+    {
+        int size = inodemapsize ? inodemapsize : 1024;
+        while (size <= traced)
+            size *= 2;
+        inodemap = realloc(inodemap, size * sizeof(int));
+        if (!inodemap)
+        {
+            printf("ERROR: out of memory\n");
+            exit(1);
+        }
+        memset(inodemap + inodemapsize, -1, (size - inodemapsize) * sizeof(int));
+        inodemapsize = size;
+    }
+    inodemap[traced] = actual;
+}
+
+static long long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void usage(const char *program)
+{
+    printf("use: %s [-o] [-c] [-u stripeunit] [-m model] <tracefile> <diskfile>[,<diskfile>...] <nblocks>\n", program);
+    printf("    -o  keep the original timing between calls instead of replaying as fast as possible\n");
+    printf("    -c  keep block checksums, to measure what they cost\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct trace_record record;
+    struct timespec start;
+    long long opcount[TRACE_NUM_OPS] = { 0 }, optime[TRACE_NUM_OPS] = { 0 };
+    long long bytesread = 0, byteswritten = 0, ncalls = 0, mismatches = 0;
+    char *buffer = NULL;
+    int buffersize = 0, originaltiming = 0, opt;
+    FILE *trace;
+
+    while ((opt = getopt(argc, argv, "cou:m:")) != -1)
+    {
+        if (opt == 'o')
+            originaltiming = 1;
+        else if (opt == 'u' && disk_set_stripe_unit(atoi(optarg)))
+            continue;
+        else if (opt == 'm' && disk_set_model(optarg))
+            continue;
+        else if (opt == 'c' && disk_set_checksums(1))
+            continue;
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    trace = trace_open_read(argv[optind]);
+    if (!trace)
+    {
+        printf("couldn't read trace %s\n", argv[optind]);
+        return 1;
+    }
+
+    if (!disk_init(argv[optind + 1], atoi(argv[optind + 2])))
+    {
+        printf("couldn't initialize %s: %s\n", argv[optind + 1], strerror(errno));
+        return 1;
+    }
+
+    // replay against a fresh file system, the trace's own format call (if any)
+    // then sets the block size it was recorded with
+    if (!fs_format())
+    {
+        printf("couldn't format %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    int startreads = disk_reads();
+    int startwrites = disk_writes();
+    double startsimtime = disk_simulated_time();
+    memset(&record, 0, sizeof(record));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (trace_read(trace, &record))
+    {
+        int inumber = map_inode(record.inumber);
+        int result = 0;
+        long long callstart;
+
+        if (originaltiming && record.time > elapsed_us(&start))
+            usleep(record.time - elapsed_us(&start));
+
+        if ((record.op == TRACE_READ || record.op == TRACE_WRITE) && record.length > buffersize)
+        {
+            buffersize = record.length;
+            buffer = realloc(buffer, buffersize);
+            if (!buffer)
+            {
+                printf("ERROR: out of memory\n");
+                return 1;
+            }
+            // writes replay the same amount of data, not the original bytes
+            for (int i = 0; i < buffersize; i++)
+                buffer[i] = 'a' + i % 26;
+        }
+
+        callstart = elapsed_us(&start);
+        switch (record.op)
+        {
+        case TRACE_FORMAT:
+            result = record.offset ? fs_format_names(record.length) : fs_format_block_size(record.length);
+            break;
+        case TRACE_MOUNT:
+            result = fs_mount();
+            break;
+        case TRACE_UNMOUNT:
+            result = fs_unmount();
+            break;
+        case TRACE_CREATE:
+            result = fs_create();
+            remember_inode(record.result, result);
+            break;
+        case TRACE_CREATE_MANY:
+        {
+            int *inumbers = malloc((record.length > 0 ? record.length : 1) * sizeof(int));
+            result = inumbers ? fs_create_many(record.length, inumbers) : -1;
+            for (int i = 0; i < result && i < record.result; i++)
+                remember_inode(record.inumbers[i], inumbers[i]);
+            free(inumbers);
+            break;
+        }
+        case TRACE_CLONE:
+            result = fs_clone(inumber);
+            remember_inode(record.result, result);
+            break;
+        case TRACE_DELETE:
+            result = fs_delete(inumber);
+            break;
+        case TRACE_GETSIZE:
+            result = fs_getsize(inumber);
+            break;
+        case TRACE_READ:
+            result = fs_read(inumber, buffer, record.length, record.offset);
+            bytesread += result;
+            break;
+        case TRACE_WRITE:
+            result = fs_write(inumber, buffer, record.length, record.offset);
+            byteswritten += result;
+            break;
+        case TRACE_LINK:
+            result = fs_link(record.name, inumber);
+            break;
+        case TRACE_LOOKUP:
+            result = fs_lookup(record.name);
+            break;
+        case TRACE_UNLINK:
+            result = fs_unlink(record.name);
+            break;
+        case TRACE_DEFRAG:
+            result = fs_defrag();
+            break;
+        case TRACE_FSCK:
+            result = fs_fsck(record.length);
+            break;
+        }
+        optime[record.op] += elapsed_us(&start) - callstart;
+        opcount[record.op]++;
+        ncalls++;
+
+        // new inode numbers and lookups can legitimately differ, only
+        // whether they succeeded has to match
+        if (record.op == TRACE_CREATE || record.op == TRACE_CLONE || record.op == TRACE_LOOKUP)
+            mismatches += (result >= 0) != (record.result >= 0);
+        else
+            mismatches += result != record.result;
+
+        free(record.inumbers);
+    }
+    fclose(trace);
+
+    double seconds = elapsed_us(&start) / 1e6;
+    if (seconds <= 0)
+        seconds = 1e-6;
+
+    printf("replayed %lld calls in %.3f s (%.0f calls/s)\n", ncalls, seconds, ncalls / seconds);
+    for (int op = 0; op < TRACE_NUM_OPS; op++)
+    {
+        if (opcount[op] > 0)
+            printf("    %-12s %10lld calls %12.1f us/call\n", trace_op_name(op), opcount[op], (double)optime[op] / opcount[op]);
+    }
+    printf("%lld bytes read (%.2f MB/s)\n", bytesread, bytesread / seconds / 1e6);
+    printf("%lld bytes written (%.2f MB/s)\n", byteswritten, byteswritten / seconds / 1e6);
+    printf("%d disk block reads, %d disk block writes\n", disk_reads() - startreads, disk_writes() - startwrites);
+    if (disk_simulated_time() > startsimtime)
+        printf("%.3f ms simulated disk time\n", (disk_simulated_time() - startsimtime) / 1000);
+    printf("%lld results differ from the trace\n", mismatches);
+
+    free(buffer);
+    free(inodemap);
+    disk_close();
+
+    return 0;
+}
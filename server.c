@@ -0,0 +1,301 @@
+#include "fs.h"
+#include "disk.h"
+#include "proto.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Stop reading requests from a client while this much of its output is unsent
+#define MAX_PENDING_OUTPUT (8 * PROTO_MAX_LENGTH)
+
+struct connection
+{
+    int fd;
+    char *in;           // received bytes not yet handled
+    size_t inlen;
+    size_t incap;
+    char *out;          // responses not yet sent, starting at outpos
+    size_t outlen;
+    size_t outpos;
+    size_t outcap;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_signal(int sig)
+{
+    stopping = 1;
+}
+
+// Makes room for length more bytes in a buffer
+static int reserve(char **buffer, size_t *cap, size_t used, size_t length)
+{
+    if (used + length <= *cap)
+        return 1;
+
+    size_t newcap = *cap ? *cap : 65536;
+    while (newcap < used + length)
+        newcap *= 2;
+    char *grown = realloc(*buffer, newcap);
+    if (!grown)
+        return 0;
+    *buffer = grown;
+    *cap = newcap;
+
+    return 1;
+}
+
+// Runs one request against the mounted file system, a read's data goes to
+// payload. Returns the fs_* result
+static int run_request(const struct proto_request *request, const char *data, char *payload)
+{
+    switch (request->op)
+    {
+    case PROTO_CREATE:
+        return fs_create();
+    case PROTO_DELETE:
+        return fs_delete(request->inumber);
+    case PROTO_GETSIZE:
+        return fs_getsize(request->inumber);
+    case PROTO_READ:
+        return fs_read(request->inumber, payload, request->length, request->offset);
+    default:
+        return fs_write(request->inumber, data, request->length, request->offset);
+    }
+}
+
+// Runs one request and queues the response
+// Returns 1 on success and 0 if the connection has to be closed
+static int handle_request(struct connection *conn, const struct proto_request *request, const char *data)
+{
+    struct proto_response response = { request->id, -1, 0 };
+
+    if (conn->outpos == conn->outlen)
+        conn->outpos = conn->outlen = 0;
+    if (!reserve(&conn->out, &conn->outcap, conn->outlen, sizeof(response) + (request->op == PROTO_READ ? request->length : 0)))
+        return 0;
+    char *payload = conn->out + conn->outlen + sizeof(response);
+
+    if (request->op < PROTO_CREATE || request->op > PROTO_WRITE)
+        return 0;
+
+    // fs.c checks inode numbers against the mounted disk, requests with
+    // negative fields are answered without calling into it
+    if (request->inumber >= 0 && request->offset >= 0)
+        response.result = run_request(request, data, payload);
+    if (request->op == PROTO_READ && response.result > 0)
+        response.length = response.result;
+
+    memcpy(conn->out + conn->outlen, &response, sizeof(response));
+    conn->outlen += sizeof(response) + response.length;
+
+    return 1;
+}
+
+// Handles every complete request received so far
+// Returns 1 on success and 0 if the connection has to be closed
+static int handle_input(struct connection *conn)
+{
+    size_t pos = 0;
+
+    while (conn->inlen - pos >= sizeof(struct proto_request) && conn->outlen - conn->outpos < MAX_PENDING_OUTPUT)
+    {
+        struct proto_request request;
+        memcpy(&request, conn->in + pos, sizeof(request));
+        if (request.length < 0 || request.length > PROTO_MAX_LENGTH)
+            return 0;
+
+        size_t datalen = request.op == PROTO_WRITE ? request.length : 0;
+        if (conn->inlen - pos < sizeof(request) + datalen)
+            break;
+        if (!handle_request(conn, &request, conn->in + pos + sizeof(request)))
+            return 0;
+        pos += sizeof(request) + datalen;
+    }
+
+    memmove(conn->in, conn->in + pos, conn->inlen - pos);
+    conn->inlen -= pos;
+
+    return 1;
+}
+
+static void close_connection(struct connection *conn)
+{
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct connection *conns = NULL;
+    struct pollfd *fds = NULL;
+    int nconns = 0, opt;
+
+    while ((opt = getopt(argc, argv, "cu:m:t:")) != -1)
+    {
+        if (opt == 'u' && disk_set_stripe_unit(atoi(optarg)))
+            continue;
+        if (opt == 'm' && disk_set_model(optarg))
+            continue;
+        if (opt == 'c' && disk_set_checksums(1))
+            continue;
+        if (opt == 't')
+        {
+            if (trace_open(optarg))
+                continue;
+            printf("couldn't open trace %s: %s\n", optarg, strerror(errno));
+            return 1;
+        }
+        printf("use: %s [-c] [-u stripeunit] [-m hdd|ssd|seek=,rotation=,latency=,bandwidth=] [-t tracefile] <socket> <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
+        return 1;
+    }
+
+    if (argc - optind != 3)
+    {
+        printf("use: %s [-c] [-u stripeunit] [-m hdd|ssd|seek=,rotation=,latency=,bandwidth=] [-t tracefile] <socket> <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
+        return 1;
+    }
+
+    if (!disk_init(argv[optind + 1], atoi(argv[optind + 2])))
+    {
+        printf("couldn't initialize %s: %s\n", argv[optind + 1], strerror(errno));
+        return 1;
+    }
+
+    // mount once, every client then shares the in-memory maps and caches
+    if (!fs_mount())
+    {
+        printf("couldn't mount %s\n", argv[optind + 1]);
+        disk_close();
+        return 1;
+    }
+
+    int listenfd = open_socket(argv[optind]);
+    if (listenfd < 0)
+    {
+        printf("couldn't listen on %s: %s\n", argv[optind], strerror(errno));
+        fs_unmount();
+        disk_close();
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    printf("serving %s on %s\n", argv[optind + 1], argv[optind]);
+    fflush(stdout);
+
+    while (!stopping)
+    {
+        fds = realloc(fds, (nconns + 1) * sizeof(struct pollfd));
+        fds[0].fd = listenfd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < nconns; i++)
+        {
+            fds[i + 1].fd = conns[i].fd;
+            fds[i + 1].events = 0;
+            if (conns[i].outlen - conns[i].outpos < MAX_PENDING_OUTPUT)
+                fds[i + 1].events |= POLLIN;
+            if (conns[i].outlen > conns[i].outpos)
+                fds[i + 1].events |= POLLOUT;
+        }
+
+        if (poll(fds, nconns + 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("ERROR: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = nconns - 1; i >= 0; i--)
+        {
+            struct connection *conn = &conns[i];
+            int ok = 1;
+
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                if (!reserve(&conn->in, &conn->incap, conn->inlen, 65536))
+                    ok = 0;
+                ssize_t n = ok ? read(conn->fd, conn->in + conn->inlen, conn->incap - conn->inlen) : -1;
+                if (n > 0)
+                    conn->inlen += n;
+                else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                    ok = 0;
+            }
+            if (ok && !handle_input(conn))
+                ok = 0;
+            if (ok && conn->outlen > conn->outpos)
+            {
+                ssize_t n = write(conn->fd, conn->out + conn->outpos, conn->outlen - conn->outpos);
+                if (n > 0)
+                    conn->outpos += n;
+                else if (n < 0 && errno != EAGAIN && errno != EINTR)
+                    ok = 0;
+            }
+
+            if (!ok)
+            {
+                close_connection(conn);
+                conns[i] = conns[--nconns];
+            }
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd;
+            while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+            {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                conns = realloc(conns, (nconns + 1) * sizeof(struct connection));
+                memset(&conns[nconns], 0, sizeof(struct connection));
+                conns[nconns++].fd = fd;
+            }
+        }
+    }
+
+    printf("shutting down\n");
+    for (int i = 0; i < nconns; i++)
+        close_connection(&conns[i]);
+    free(conns);
+    free(fds);
+    close(listenfd);
+    unlink(argv[optind]);
+    fs_unmount();
+    disk_close();
+    trace_close();
+
+    return 0;
+}
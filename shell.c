@@ -1,13 +1,22 @@
 #include "fs.h"
 #include "disk.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 static int do_copyin(const char *filename, int inumber);
 static int do_copyout(int inumber, const char *filename);
+static int do_bulkin(const char *dirname);
+static int do_bulkout(const char *dirname, char *inodes);
 
 int main(int argc, char *argv[])
 {
@@ -15,24 +24,49 @@ int main(int argc, char *argv[])
     char cmd[1024];
     char arg1[1024];
     char arg2[1024];
-    int inumber, result, args;
+    int inumber, result, args, opt;
+    int simulated = 0;
 
-    if (argc != 3)
+    while ((opt = getopt(argc, argv, "cu:m:t:")) != -1)
     {
-        printf("use: %s <diskfile> <nblocks>\n", argv[0]);
+        if (opt == 'u' && disk_set_stripe_unit(atoi(optarg)))
+            continue;
+        if (opt == 'c' && disk_set_checksums(1))
+            continue;
+        if (opt == 't')
+        {
+            if (trace_open(optarg))
+                continue;
+            printf("couldn't open trace %s: %s\n", optarg, strerror(errno));
+            return 1;
+        }
+        if (opt == 'm' && disk_set_model(optarg))
+        {
+            simulated = 1;
+            continue;
+        }
+        printf("use: %s [-c] [-u stripeunit] [-m hdd|ssd|seek=,rotation=,latency=,bandwidth=] [-t tracefile] <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
         return 1;
     }
 
-    if (!disk_init(argv[1], atoi(argv[2])))
+    if (argc - optind != 2)
     {
-        printf("couldn't initialize %s: %s\n", argv[1], strerror(errno));
+        printf("use: %s [-c] [-u stripeunit] [-m hdd|ssd|seek=,rotation=,latency=,bandwidth=] [-t tracefile] <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
         return 1;
     }
 
-    printf("opened emulated disk image %s with %d blocks\n", argv[1], disk_size());
+    if (!disk_init(argv[optind], atoi(argv[optind + 1])))
+    {
+        printf("couldn't initialize %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    printf("opened emulated disk image %s with %d blocks\n", argv[optind], disk_size());
 
     while (1)
     {
+        double simstart = disk_simulated_time();
+
         printf(" simplefs> ");
         fflush(stdout);
 
@@ -49,9 +83,11 @@ int main(int argc, char *argv[])
 
         if (!strcmp(cmd, "format"))
         {
-            if (args == 1)
+            int names = args > 1 && !strcmp(args == 3 ? arg2 : arg1, "names");
+            if (args == 1 || args == 2 || (args == 3 && names))
             {
-                if (fs_format())
+                int size = args == 1 || (args == 2 && names) ? DISK_BLOCK_SIZE : atoi(arg1);
+                if (names ? fs_format_names(size) : args == 1 ? fs_format() : fs_format_block_size(size))
                 {
                     printf("disk formatted.\n");
                 }
@@ -62,7 +98,7 @@ int main(int argc, char *argv[])
             }
             else
             {
-                printf("use: format\n");
+                printf("use: format [blocksize] [names]\n");
             }
         }
         else if (!strcmp(cmd, "mount"))
@@ -112,6 +148,60 @@ int main(int argc, char *argv[])
                 printf("use: debug\n");
             }
         }
+        else if (!strcmp(cmd, "defrag"))
+        {
+            if (args == 1)
+            {
+                double before = fs_fragmentation();
+                result = fs_defrag();
+                if (result >= 0)
+                {
+                    printf("moved %d files, fragmentation %.1f%% -> %.1f%%\n", result, before, fs_fragmentation());
+                }
+                else
+                {
+                    printf("defrag failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: defrag\n");
+            }
+        }
+        else if (!strcmp(cmd, "fsck"))
+        {
+            if (args == 1 || (args == 2 && !strcmp(arg1, "repair")))
+            {
+                result = fs_fsck(args == 2);
+                if (result < 0)
+                {
+                    printf("fsck failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: fsck [repair]\n");
+            }
+        }
+        else if (!strcmp(cmd, "scrub"))
+        {
+            if (args == 1)
+            {
+                result = disk_scrub();
+                if (result >= 0)
+                {
+                    printf("%d bad blocks found\n", result);
+                }
+                else
+                {
+                    printf("scrub failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: scrub\n");
+            }
+        }
         else if (!strcmp(cmd, "getsize"))
         {
             if (args == 2)
@@ -147,9 +237,43 @@ int main(int argc, char *argv[])
                     printf("create failed!\n");
                 }
             }
+            else if (args == 2 && atoi(arg1) > 0)
+            {
+                int count = atoi(arg1);
+                int *inumbers = malloc(count * sizeof(int));
+                if (inumbers && fs_create_many(count, inumbers) == count)
+                {
+                    printf("created %d inodes from %d to %d\n", count, inumbers[0], inumbers[count - 1]);
+                }
+                else
+                {
+                    printf("create failed!\n");
+                }
+                free(inumbers);
+            }
+            else
+            {
+                printf("use: create [count]\n");
+            }
+        }
+        else if (!strcmp(cmd, "clone"))
+        {
+            if (args == 2)
+            {
+                inumber = atoi(arg1);
+                result = fs_clone(inumber);
+                if (result >= 0)
+                {
+                    printf("cloned inode %d to inode %d\n", inumber, result);
+                }
+                else
+                {
+                    printf("clone failed!\n");
+                }
+            }
             else
             {
-                printf("use: create\n");
+                printf("use: clone <inumber>\n");
             }
         }
         else if (!strcmp(cmd, "delete"))
@@ -171,6 +295,62 @@ int main(int argc, char *argv[])
                 printf("use: delete <inumber>\n");
             }
         }
+        else if (!strcmp(cmd, "link"))
+        {
+            if (args == 3)
+            {
+                inumber = atoi(arg2);
+                if (fs_link(arg1, inumber))
+                {
+                    printf("linked %s to inode %d\n", arg1, inumber);
+                }
+                else
+                {
+                    printf("link failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: link <name> <inumber>\n");
+            }
+        }
+        else if (!strcmp(cmd, "lookup"))
+        {
+            if (args == 2)
+            {
+                inumber = fs_lookup(arg1);
+                if (inumber >= 0)
+                {
+                    printf("%s is inode %d\n", arg1, inumber);
+                }
+                else
+                {
+                    printf("lookup failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: lookup <name>\n");
+            }
+        }
+        else if (!strcmp(cmd, "unlink"))
+        {
+            if (args == 2)
+            {
+                if (fs_unlink(arg1))
+                {
+                    printf("unlinked %s\n", arg1);
+                }
+                else
+                {
+                    printf("unlink failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: unlink <name>\n");
+            }
+        }
         else if (!strcmp(cmd, "cat"))
         {
             if (args == 2)
@@ -224,19 +404,59 @@ int main(int argc, char *argv[])
                 printf("use: copyout <inumber> <filename>\n");
             }
         }
+        else if (!strcmp(cmd, "bulkin"))
+        {
+            if (args == 2)
+            {
+                if (!do_bulkin(arg1))
+                {
+                    printf("bulk copy failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: bulkin <directory>\n");
+            }
+        }
+        else if (!strcmp(cmd, "bulkout"))
+        {
+            int skip = 0;
+            if (args == 3)
+                sscanf(line, "%*s %*s %n", &skip);
+            if (skip > 0)
+            {
+                if (!do_bulkout(arg1, line + skip))
+                {
+                    printf("bulk copy failed!\n");
+                }
+            }
+            else
+            {
+                printf("use: bulkout <directory> <inode|first-last>...\n");
+            }
+        }
         else if (!strcmp(cmd, "help"))
         {
             printf("Commands are:\n");
-            printf("    format\n");
+            printf("    format  [blocksize] [names]\n");
             printf("    mount\n");
             printf("    unmount\n");
             printf("    debug\n");
-            printf("    create\n");
+            printf("    defrag\n");
+            printf("    fsck    [repair]\n");
+            printf("    scrub\n");
+            printf("    create  [count]\n");
+            printf("    clone   <inode>\n");
             printf("    delete  <inode>\n");
             printf("    getsize <inode>\n");
+            printf("    link    <name> <inode>\n");
+            printf("    lookup  <name>\n");
+            printf("    unlink  <name>\n");
             printf("    cat     <inode>\n");
             printf("    copyin  <file> <inode>\n");
             printf("    copyout <inode> <file>\n");
+            printf("    bulkin  <directory>\n");
+            printf("    bulkout <directory> <inode|first-last>...\n");
             printf("    help\n");
             printf("    quit\n");
             printf("    exit\n");
@@ -253,10 +473,16 @@ int main(int argc, char *argv[])
             printf("type 'help' for a list of commands.\n");
             result = 1;
         }
+
+        if (simulated && disk_simulated_time() > simstart)
+        {
+            printf("simulated disk time: %.3f ms\n", (disk_simulated_time() - simstart) / 1000);
+        }
     }
 
     printf("closing emulated disk.\n");
     disk_close();
+    trace_close();
 
     return 0;
 }
@@ -329,3 +555,275 @@ static int do_copyout(int inumber, const char *filename)
     fclose(file);
     return 1;
 }
+
+// One file moved by a bulk copy. Workers claim jobs in order and fill in the
+// outcome, which the shell reports once every worker is done
+struct bulk_job
+{
+    char path[1024];
+    const char *name;   // last component of path, NULL to copy without a name
+    int inumber;
+    long long bytes;
+    int error;          // errno of the failed host call, -1 if the file system failed
+};
+
+struct bulk_pool
+{
+    struct bulk_job *jobs;
+    int njobs;
+    int next;           // next job to claim
+    int tofs;           // copying into the file system
+};
+
+// Workers per processor. While one worker waits on the host file another can
+// be inside the file system, so more workers than processors keeps I/O in flight
+#define BULK_WORKERS_PER_CPU 2
+#define BULK_CHUNK (256 * 1024)
+#define BULK_NAME_MAX 27    // longest name fs_link accepts
+
+// Copies a host file into its inode and links its name, if it has one. The
+// kernel is asked to fetch the next chunk of the host file while the current
+// one is written to the image. The name is checked before any data is copied,
+// and the inode is deleted again if the copy fails
+static void bulk_copyin(struct bulk_job *job, char *buffer)
+{
+    if (job->name && strlen(job->name) > BULK_NAME_MAX)
+        job->error = ENAMETOOLONG;
+    else if (job->name && fs_lookup(job->name) >= 0)
+        job->error = EEXIST;
+    int fd = job->error ? -1 : open(job->path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (!job->error)
+            job->error = errno;
+        fs_delete(job->inumber);
+        return;
+    }
+
+    while (1)
+    {
+        ssize_t result = read(fd, buffer, BULK_CHUNK);
+        if (result < 0)
+            job->error = errno;
+        if (result <= 0)
+            break;
+        posix_fadvise(fd, job->bytes + result, BULK_CHUNK, POSIX_FADV_WILLNEED);
+        if (fs_write(job->inumber, buffer, result, job->bytes) != result)
+        {
+            job->error = -1;
+            break;
+        }
+        job->bytes += result;
+    }
+    close(fd);
+
+    // the name was checked above, so only a full index turns it away
+    if (!job->error && job->name && !fs_link(job->name, job->inumber))
+        job->error = ENOSPC;
+    if (job->error)
+        fs_delete(job->inumber);
+}
+
+// Copies an inode to a host file. Host writes land in the page cache and are
+// written back while the worker goes on reading the image
+static void bulk_copyout(struct bulk_job *job, char *buffer)
+{
+    int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        job->error = errno;
+        return;
+    }
+
+    int size = fs_getsize(job->inumber);
+    if (size < 0)
+        job->error = -1;
+    while (!job->error && job->bytes < size)
+    {
+        int result = fs_read(job->inumber, buffer, BULK_CHUNK, job->bytes);
+        if (result <= 0)
+        {
+            job->error = -1;
+            break;
+        }
+        ssize_t written = write(fd, buffer, result);
+        if (written != result)
+        {
+            job->error = written < 0 ? errno : EIO;
+            break;
+        }
+        job->bytes += result;
+    }
+    close(fd);
+
+    if (job->error)
+        unlink(job->path);
+}
+
+static void *bulk_worker(void *arg)
+{
+    struct bulk_pool *pool = arg;
+    char *buffer = malloc(BULK_CHUNK);
+
+    while (buffer)
+    {
+        int index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (index >= pool->njobs)
+            break;
+        if (pool->tofs)
+            bulk_copyin(&pool->jobs[index], buffer);
+        else
+            bulk_copyout(&pool->jobs[index], buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Runs every job of the pool, then reports failures and totals
+// Returns 1 if every job succeeded and 0 otherwise
+static int bulk_run(struct bulk_pool *pool)
+{
+    struct timespec start, end;
+    long long bytes = 0;
+    int failed = 0;
+
+    int nworkers = BULK_WORKERS_PER_CPU * sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > pool->njobs)
+        nworkers = pool->njobs;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *workers = calloc(nworkers, sizeof(pthread_t));
+    int started = 0;
+    while (workers && started < nworkers && pthread_create(&workers[started], NULL, bulk_worker, pool) == 0)
+        started++;
+    if (started == 0)
+        bulk_worker(pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; i < pool->njobs; i++)
+    {
+        struct bulk_job *job = &pool->jobs[i];
+        if (!job->error)
+        {
+            bytes += job->bytes;
+            continue;
+        }
+        failed++;
+        if (job->error > 0)
+            printf("couldn't copy %s: %s\n", job->path, strerror(job->error));
+        else
+            printf("couldn't copy %s\n", job->path);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d files (%lld bytes) copied with %d workers in %.3f s (%.1f MB/s)\n",
+           pool->njobs - failed, bytes, started ? started : 1, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0);
+
+    return failed == 0;
+}
+
+static int do_bulkin(const char *dirname)
+{
+    struct bulk_pool pool = { NULL, 0, 0, 1 };
+    struct dirent *entry;
+    struct stat info;
+    int capacity = 0, ok = 0;
+
+    DIR *dir = opendir(dirname);
+    if (!dir)
+    {
+        printf("couldn't open %s: %s\n", dirname, strerror(errno));
+        return 0;
+    }
+
+    while ((entry = readdir(dir)))
+    {
+        if (pool.njobs == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            pool.jobs = realloc(pool.jobs, capacity * sizeof(struct bulk_job));
+        }
+        struct bulk_job *job = &pool.jobs[pool.njobs];
+        memset(job, 0, sizeof(*job));
+        snprintf(job->path, sizeof(job->path), "%s/%s", dirname, entry->d_name);
+        if (stat(job->path, &info) == 0 && S_ISREG(info.st_mode))
+            pool.njobs++;
+    }
+    closedir(dir);
+
+    if (pool.njobs == 0)
+    {
+        printf("no files in %s\n", dirname);
+        free(pool.jobs);
+        return 1;
+    }
+
+    // every inode is allocated up front so that workers only write data
+    int named = fs_has_names();
+    int *inumbers = malloc(pool.njobs * sizeof(int));
+    if (inumbers && fs_create_many(pool.njobs, inumbers) == pool.njobs)
+    {
+        for (int i = 0; i < pool.njobs; i++)
+        {
+            pool.jobs[i].inumber = inumbers[i];
+            pool.jobs[i].name = named ? strrchr(pool.jobs[i].path, '/') + 1 : NULL;
+        }
+        if (!named)
+            printf("disk has no name index, files are copied without names\n");
+        printf("copying into inodes %d to %d\n", inumbers[0], inumbers[pool.njobs - 1]);
+        ok = bulk_run(&pool);
+    }
+
+    free(inumbers);
+    free(pool.jobs);
+    return ok;
+}
+
+// Each argument is an inode number or a range of them such as 10-99
+static int do_bulkout(const char *dirname, char *inodes)
+{
+    struct bulk_pool pool = { NULL, 0, 0, 0 };
+    int capacity = 0, ok;
+
+    for (char *arg = strtok(inodes, " \t"); arg; arg = strtok(NULL, " \t"))
+    {
+        int first, last, end = 0;
+        if (sscanf(arg, "%d-%d%n", &first, &last, &end) != 2 || arg[end] != '\0')
+        {
+            end = 0;
+            if (sscanf(arg, "%d%n", &first, &end) != 1 || arg[end] != '\0')
+            {
+                printf("not an inode number or range: %s\n", arg);
+                free(pool.jobs);
+                return 0;
+            }
+            last = first;
+        }
+        for (int inumber = first; inumber <= last; inumber++)
+        {
+            if (pool.njobs == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                pool.jobs = realloc(pool.jobs, capacity * sizeof(struct bulk_job));
+            }
+            struct bulk_job *job = &pool.jobs[pool.njobs++];
+            memset(job, 0, sizeof(*job));
+            job->inumber = inumber;
+            snprintf(job->path, sizeof(job->path), "%s/%d", dirname, inumber);
+            job->name = strrchr(job->path, '/') + 1;
+        }
+    }
+
+    if (pool.njobs == 0)
+        return 0;
+
+    ok = bulk_run(&pool);
+    free(pool.jobs);
+    return ok;
+}
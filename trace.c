@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_MAGIC "SFSTRACE"
+
+// Records are an op byte followed by variable length integers: the time since
+// the previous record, inumber, offset, length and result. Signed values are
+// zigzag encoded so small negative numbers stay small. Name operations add a
+// length prefixed name and TRACE_CREATE_MANY adds the inode numbers created
+
+static FILE *tracefile;
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec tracestart;
+static long long lasttime;
+
+static const char *op_names[TRACE_NUM_OPS] = {
+    "format", "mount", "unmount", "create", "create_many", "clone", "delete",
+    "getsize", "read", "write", "link", "lookup", "unlink", "defrag", "fsck",
+};
+
+const char *trace_op_name(int op)
+{
+    if (op < 0 || op >= TRACE_NUM_OPS)
+        return "unknown";
+
+    return op_names[op];
+}
+
+int trace_open(const char *filename)
+{
+    trace_close();
+
+    FILE *file = fopen(filename, "w");
+    if (!file)
+        return 0;
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file);
+
+    pthread_mutex_lock(&tracelock);
+    clock_gettime(CLOCK_MONOTONIC, &tracestart);
+    lasttime = 0;
+    tracefile = file;
+    pthread_mutex_unlock(&tracelock);
+
+    return 1;
+}
+
+void trace_close()
+{
+    pthread_mutex_lock(&tracelock);
+    if (tracefile)
+    {
+        fclose(tracefile);
+        tracefile = 0;
+    }
+    pthread_mutex_unlock(&tracelock);
+}
+
+long long trace_now()
+{
+    struct timespec now;
+
+    if (!tracefile)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - tracestart.tv_sec) * 1000000LL + (now.tv_nsec - tracestart.tv_nsec) / 1000;
+}
+
+static void put_varint(FILE *file, long long value)
+{
+    uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+
+    while (zigzag >= 0x80)
+    {
+        fputc((zigzag & 0x7f) | 0x80, file);
+        zigzag >>= 7;
+    }
+    fputc(zigzag, file);
+}
+
+static int get_varint(FILE *file, long long *value)
+{
+    uint64_t zigzag = 0;
+    int c;
+
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if ((c = fgetc(file)) == EOF)
+            return 0;
+        zigzag |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            *value = (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void trace_record(int op, long long time, int inumber, int offset, int length, int result,
+                  const char *name, const int *inumbers)
+{
+    if (!tracefile)
+        return;
+
+    pthread_mutex_lock(&tracelock);
+    if (tracefile)
+    {
+        // calls on other threads may have been recorded since this one started
+        fputc(op, tracefile);
+        put_varint(tracefile, time - lasttime);
+        put_varint(tracefile, inumber);
+        put_varint(tracefile, offset);
+        put_varint(tracefile, length);
+        put_varint(tracefile, result);
+        lasttime = time;
+
+        if (op == TRACE_LINK || op == TRACE_LOOKUP || op == TRACE_UNLINK)
+        {
+            size_t namelength = strnlen(name, TRACE_NAME_LENGTH - 1);
+            put_varint(tracefile, namelength);
+            fwrite(name, 1, namelength, tracefile);
+        }
+        if (op == TRACE_CREATE_MANY)
+        {
+            for (int i = 0; i < result; i++)
+                put_varint(tracefile, inumbers[i]);
+        }
+    }
+    pthread_mutex_unlock(&tracelock);
+}
+
+FILE *trace_open_read(const char *filename)
+{
+    char magic[sizeof(TRACE_MAGIC)] = { 0 };
+    FILE *file = fopen(filename, "r");
+
+    if (!file)
+        return NULL;
+
+    if (fread(magic, 1, strlen(TRACE_MAGIC), file) != strlen(TRACE_MAGIC) || strcmp(magic, TRACE_MAGIC))
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+int trace_read(FILE *file, struct trace_record *record)
+{
+    long long delta, inumber, offset, length, result, value;
+    int op = fgetc(file);
+
+    record->inumbers = NULL;
+    if (op == EOF || op >= TRACE_NUM_OPS)
+        return 0;
+
+    if (!get_varint(file, &delta) || !get_varint(file, &inumber) || !get_varint(file, &offset) ||
+        !get_varint(file, &length) || !get_varint(file, &result))
+        return 0;
+
+    record->op = op;
+    record->time += delta;
+    record->inumber = inumber;
+    record->offset = offset;
+    record->length = length;
+    record->result = result;
+    record->name[0] = 0;
+
+    if (op == TRACE_LINK || op == TRACE_LOOKUP || op == TRACE_UNLINK)
+    {
+        if (!get_varint(file, &value) || value < 0 || value >= TRACE_NAME_LENGTH ||
+            fread(record->name, 1, value, file) != (size_t)value)
+            return 0;
+        record->name[value] = 0;
+    }
+    if (op == TRACE_CREATE_MANY && result > 0)
+    {
+        record->inumbers = malloc(result * sizeof(int));
+        if (!record->inumbers)
+            return 0;
+        for (int i = 0; i < result; i++)
+        {
+            if (!get_varint(file, &value))
+            {
+                free(record->inumbers);
+                record->inumbers = NULL;
+                return 0;
+            }
+            record->inumbers[i] = value;
+        }
+    }
+
+    return 1;
+}
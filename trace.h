@@ -0,0 +1,71 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+// Operations recorded in a trace, one per fs_* call
+enum trace_op
+{
+    TRACE_FORMAT,       // length is the block size, offset 1 with a name index
+    TRACE_MOUNT,
+    TRACE_UNMOUNT,
+    TRACE_CREATE,
+    TRACE_CREATE_MANY,  // length is the number of files, inumbers the files created
+    TRACE_CLONE,
+    TRACE_DELETE,
+    TRACE_GETSIZE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_LINK,
+    TRACE_LOOKUP,
+    TRACE_UNLINK,
+    TRACE_DEFRAG,
+    TRACE_FSCK,         // length is the repair flag
+    TRACE_NUM_OPS
+};
+
+#define TRACE_NAME_LENGTH 256
+
+struct trace_record
+{
+    int op;                         // enum trace_op
+    long long time;                 // microseconds from the start of the trace to the call
+    int inumber;                    // inode operated on (-1 if none)
+    int offset;
+    int length;
+    int result;                     // value the call returned
+    char name[TRACE_NAME_LENGTH];   // name for the name index operations
+    int *inumbers;                  // files created by TRACE_CREATE_MANY (malloc'd, NULL otherwise)
+};
+
+// Returns the name of an operation
+const char *trace_op_name(int op);
+
+// Start recording every fs_* call to the trace file specified, replacing it
+// Returns 1 on success and 0 on failure
+int trace_open(const char *filename);
+
+// Stop recording and close the trace file
+void trace_close();
+
+// Returns the time since the trace was opened in microseconds, or 0 if no
+// trace is being recorded
+long long trace_now();
+
+// Append a call that started at the time given to the trace. Does nothing if
+// no trace is being recorded. name may be NULL, inumbers is only used for
+// TRACE_CREATE_MANY and holds result entries
+void trace_record(int op, long long time, int inumber, int offset, int length, int result,
+                  const char *name, const int *inumbers);
+
+// Open a trace file for reading
+// Returns the file on success and NULL on failure
+FILE *trace_open_read(const char *filename);
+
+// Read the next call from a trace opened with trace_open_read. Times are
+// stored relative to the previous call, so record must start out zeroed and
+// be passed to every call. The caller frees record->inumbers
+// Returns 1 on success and 0 at the end of the trace or on a corrupt record
+int trace_read(FILE *file, struct trace_record *record);
+
+#endif